@@ -1,6 +1,9 @@
 use std::fs;
 use std::env;
 use std::net::UdpSocket;
+use std::collections::HashSet;
+use std::time::{Duration, Instant, SystemTime, UNIX_EPOCH};
+use std::thread;
 use network_interface::{NetworkInterface, NetworkInterfaceConfig, V4IfAddr, Addr};
 use serde::{Serialize, Deserialize};
 
@@ -172,12 +175,322 @@ impl SerAble for Popping {
     }
 }
 
+#[derive(Deserialize, Serialize)]
+enum RacerEdge {
+    Wrap,
+    Bounce,
+}
+
+impl RacerEdge {
+    fn as_num(&self) -> u8 {
+        match self {
+            RacerEdge::Wrap => 1,
+            RacerEdge::Bounce => 2,
+        }
+    }
+}
+
+#[derive(Deserialize, Serialize)]
+struct Racer {
+    count: u16,
+    minspeed: i16,
+    maxspeed: i16,
+    minaccel: i16,
+    maxaccel: i16,
+    speedlimit: u16,
+    trail: u8,
+    edge: RacerEdge,
+    bg: Color,
+    colors: Palette,
+}
+
+impl SerAble for Racer {
+    fn ser(&self, v: &mut Vec<u8>) {
+        v.extend_from_slice(&self.count.to_le_bytes());
+        v.extend_from_slice(&self.minspeed.to_le_bytes());
+        v.extend_from_slice(&self.maxspeed.to_le_bytes());
+        v.extend_from_slice(&self.minaccel.to_le_bytes());
+        v.extend_from_slice(&self.maxaccel.to_le_bytes());
+        v.extend_from_slice(&self.speedlimit.to_le_bytes());
+        v.push(self.trail);
+        v.push(self.edge.as_num());
+        self.bg.ser(v);
+        self.colors.ser(v);
+    }
+}
+
+#[derive(Deserialize, Serialize)]
+enum VmOp {
+    Halt,
+    Ldi,
+    Ldhi,
+    Addi,
+    Mov,
+    Add,
+    Sub,
+    Mul,
+    Mulq,
+    Div,
+    Mod,
+    And,
+    Or,
+    Xor,
+    Shl,
+    Shr,
+    Min,
+    Max,
+    Abs,
+    Lt,
+    Tri,
+    Rand,
+    Jmp,
+    Jz,
+    Grad,
+    Pal,
+    Rgb,
+    Scale,
+}
+
+impl VmOp {
+    fn as_num(&self) -> u8 {
+        match self {
+            VmOp::Halt => 0,
+            VmOp::Ldi => 1,
+            VmOp::Ldhi => 2,
+            VmOp::Addi => 3,
+            VmOp::Mov => 4,
+            VmOp::Add => 5,
+            VmOp::Sub => 6,
+            VmOp::Mul => 7,
+            VmOp::Mulq => 8,
+            VmOp::Div => 9,
+            VmOp::Mod => 10,
+            VmOp::And => 11,
+            VmOp::Or => 12,
+            VmOp::Xor => 13,
+            VmOp::Shl => 14,
+            VmOp::Shr => 15,
+            VmOp::Min => 16,
+            VmOp::Max => 17,
+            VmOp::Abs => 18,
+            VmOp::Lt => 19,
+            VmOp::Tri => 20,
+            VmOp::Rand => 21,
+            VmOp::Jmp => 22,
+            VmOp::Jz => 23,
+            VmOp::Grad => 24,
+            VmOp::Pal => 25,
+            VmOp::Rgb => 26,
+            VmOp::Scale => 27,
+        }
+    }
+
+    fn has_imm(&self) -> bool {
+        matches!(self, VmOp::Ldi | VmOp::Ldhi | VmOp::Addi | VmOp::Jmp)
+    }
+}
+
+#[derive(Deserialize, Serialize)]
+struct VmInstr {
+    op: VmOp,
+    #[serde(default)]
+    a: u8,
+    #[serde(default)]
+    b: u8,
+    #[serde(default)]
+    c: u8,
+    #[serde(default)]
+    imm: i16,
+}
+
+impl SerAble for VmInstr {
+    fn ser(&self, v: &mut Vec<u8>) {
+        v.push(self.op.as_num());
+        v.push(self.a);
+        if self.op.has_imm() {
+            v.extend_from_slice(&self.imm.to_le_bytes());
+        } else {
+            v.push(self.b);
+            v.push(self.c);
+        }
+    }
+}
+
+#[derive(Deserialize, Serialize)]
+struct Program {
+    duration: u16,
+    frame: Vec<VmInstr>,
+    pixel: Vec<VmInstr>,
+    grad: Gradient,
+    colors: Palette,
+}
+
+impl SerAble for Program {
+    fn ser(&self, v: &mut Vec<u8>) {
+        v.extend_from_slice(&self.duration.to_le_bytes());
+        v.extend_from_slice(&(self.frame.len() as u16).to_le_bytes());
+        v.extend_from_slice(&(self.pixel.len() as u16).to_le_bytes());
+        for op in &self.frame {
+            op.ser(v);
+        }
+        for op in &self.pixel {
+            op.ser(v);
+        }
+        self.grad.ser(v);
+        self.colors.ser(v);
+    }
+}
+
+#[derive(Deserialize, Serialize)]
+enum LayerBlend {
+    Add,
+    Multiply,
+    Max,
+    Over,
+}
+
+impl LayerBlend {
+    fn as_num(&self) -> u8 {
+        match self {
+            LayerBlend::Add => 1,
+            LayerBlend::Multiply => 2,
+            LayerBlend::Max => 3,
+            LayerBlend::Over => 4,
+        }
+    }
+}
+
+#[derive(Deserialize, Serialize)]
+struct Layer {
+    blend: LayerBlend,
+    opacity: u8,
+    pattern: Pattern,
+}
+
+impl SerAble for Layer {
+    fn ser(&self, v: &mut Vec<u8>) {
+        let mut pv: Vec<u8> = Vec::new();
+        self.pattern.ser(&mut pv);
+
+        v.push(self.blend.as_num());
+        v.push(self.opacity);
+        v.extend_from_slice(&(pv.len() as u16).to_le_bytes());
+        v.extend_from_slice(&pv);
+    }
+}
+
+#[derive(Deserialize, Serialize)]
+struct Layers {
+    layers: Vec<Layer>,
+}
+
+impl SerAble for Layers {
+    fn ser(&self, v: &mut Vec<u8>) {
+        v.push(self.layers.len() as u8);
+
+        for l in &self.layers {
+            l.ser(v);
+        }
+    }
+}
+
+#[derive(Deserialize, Serialize)]
+struct Point {
+    x: i16,
+    y: i16,
+}
+
+#[derive(Deserialize, Serialize)]
+enum Shape {
+    Points(Vec<Point>),
+    // rows of width leds, every other row running back the other way
+    Serpentine { count: u16, width: u16, spacing: i16 },
+    Ring { count: u16, radius: i16 },
+}
+
+// where the leds physically are, sent once and kept by the device
+#[derive(Deserialize, Serialize)]
+struct Layout {
+    cx: i16,
+    cy: i16,
+    // which way linear runs, and where angular starts, 0x10000 is a full turn from +x
+    dir: u16,
+    shape: Shape,
+}
+
+impl Layout {
+    fn points(&self) -> Vec<Point> {
+        match &self.shape {
+            Shape::Points(pts) => pts.iter().map(|p| Point { x: p.x, y: p.y }).collect(),
+            Shape::Serpentine { count, width, spacing } => (0..*count)
+                .map(|i| {
+                    let row = i / width;
+                    let col = if row % 2 == 0 { i % width } else { width - 1 - (i % width) };
+                    Point { x: col as i16 * spacing, y: row as i16 * spacing }
+                })
+                .collect(),
+            Shape::Ring { count, radius } => (0..*count)
+                .map(|i| {
+                    let a = (i as f32) * std::f32::consts::TAU / (*count as f32);
+                    Point {
+                        x: (a.cos() * *radius as f32).round() as i16,
+                        y: (a.sin() * *radius as f32).round() as i16,
+                    }
+                })
+                .collect(),
+        }
+    }
+}
+
+impl SerAble for Layout {
+    fn ser(&self, v: &mut Vec<u8>) {
+        let pts = self.points();
+
+        v.extend_from_slice(&self.cx.to_le_bytes());
+        v.extend_from_slice(&self.cy.to_le_bytes());
+        v.extend_from_slice(&self.dir.to_le_bytes());
+        v.extend_from_slice(&(pts.len() as u16).to_le_bytes());
+        for p in pts {
+            v.extend_from_slice(&p.x.to_le_bytes());
+            v.extend_from_slice(&p.y.to_le_bytes());
+        }
+    }
+}
+
+// how a pattern's line lands on the leds, everything but Strip needs a Layout sent first
+#[derive(Deserialize, Serialize, Default)]
+enum PixelMap {
+    #[default]
+    Strip,
+    Linear,
+    Radial,
+    Angular,
+    // popping only, spots are round on the layout, sizes are in cells of a 16x16 grid
+    Grid,
+}
+
+impl PixelMap {
+    fn as_num(&self) -> u8 {
+        match self {
+            PixelMap::Strip => 0,
+            PixelMap::Linear => 1,
+            PixelMap::Radial => 2,
+            PixelMap::Angular => 3,
+            PixelMap::Grid => 4,
+        }
+    }
+}
+
 #[derive(Deserialize, Serialize)]
 enum PatternType {
     Grad(Gradient),
     AniGrad(AniGradient),
     RandGrad(RandGradient),
     Popping(Popping),
+    Program(Program),
+    Racer(Racer),
+    Layers(Layers),
+    Layout(Layout),
 }
 
 impl PatternType {
@@ -187,6 +500,10 @@ impl PatternType {
             PatternType::AniGrad(_) => 2,
             PatternType::RandGrad(_) => 3,
             PatternType::Popping(_) => 4,
+            PatternType::Program(_) => 5,
+            PatternType::Racer(_) => 6,
+            PatternType::Layers(_) => 7,
+            PatternType::Layout(_) => 8,
         }
     }
 }
@@ -199,6 +516,10 @@ impl SerAble for PatternType {
             PatternType::AniGrad(ag) => ag.ser(v),
             PatternType::RandGrad(rg) => rg.ser(v),
             PatternType::Popping(pp) => pp.ser(v),
+            PatternType::Program(pg) => pg.ser(v),
+            PatternType::Racer(rc) => rc.ser(v),
+            PatternType::Layers(ls) => ls.ser(v),
+            PatternType::Layout(lo) => lo.ser(v),
         };
     }
 }
@@ -207,6 +528,25 @@ impl SerAble for PatternType {
 struct Pattern {
     timeout: u16,
     pat: PatternType,
+    #[serde(default)]
+    map: PixelMap,
+    // picked at send time, resends keep it so the device can drop repeats
+    #[serde(skip)]
+    seq: u16,
+}
+
+// where the hash sits in the header, after type, timeout and seq
+const HASH_OFF: usize = 5;
+const HASH_LEN: usize = 4;
+
+fn fnv1a(buf: &[u8]) -> u32 {
+    // the hash field counts as zeros
+    let mut h: u32 = 0x811c9dc5;
+    for (i, b) in buf.iter().enumerate() {
+        let b = if (HASH_OFF..HASH_OFF + HASH_LEN).contains(&i) { 0 } else { *b };
+        h = (h ^ (b as u32)).wrapping_mul(0x01000193);
+    }
+    h
 }
 
 impl Pattern {
@@ -215,6 +555,9 @@ impl Pattern {
 
         self.ser(&mut v);
 
+        let hash = fnv1a(&v);
+        v[HASH_OFF..HASH_OFF + HASH_LEN].copy_from_slice(&hash.to_le_bytes());
+
         v
     }
 }
@@ -223,28 +566,37 @@ impl SerAble for Pattern {
     fn ser(&self, v: &mut Vec<u8>) {
         v.push(self.pat.as_num());
         v.extend_from_slice(&self.timeout.to_le_bytes());
+        v.extend_from_slice(&self.seq.to_le_bytes());
+        // filled in once the whole packet is serialized
+        v.extend_from_slice(&[0; HASH_LEN]);
+        v.push(self.map.as_num());
         self.pat.ser(v);
     }
 }
 
+const ACK_WAIT: Duration = Duration::from_millis(250);
+const MAX_SENDS: u32 = 8;
+
+// seq, hash, device id
+const ACK_LEN: usize = 10;
 
-fn send_pattern(pat: Pattern) {
+// with no expected count it can't know when everyone has it, so it resends for the whole window
+fn send_pattern(pat: Pattern, expect: Option<usize>) {
 
     let buf = pat.serialize();
+    let seq = &buf[3..5];
+    let hash = &buf[HASH_OFF..HASH_OFF + HASH_LEN];
 
     // we need to bind to the right interface, or the multicast packet will go out the wrong hole
     // so let's just try them all
+    let mut sockets: Vec<UdpSocket> = Vec::new();
     for interface in NetworkInterface::show().unwrap() {
         if let Some(Addr::V4(V4IfAddr{ip: theip, ..})) = interface.addr {
             if !theip.is_loopback() && !theip.is_link_local() {
                 let socket_res = UdpSocket::bind((theip, 0));
                 if let Ok(socket) = socket_res {
-                    if let Ok(amt) = socket.send_to(buf.as_slice(), "239.3.6.9:3690") {
-                        if amt != buf.len() {
-                            println!("Warning: Did not send the full packet on interface at {:?}, skipping", theip);
-                        }
-                    } else {
-                        println!("Warning: Failed to send on interface {:?}, skipping", theip);
+                    if socket.set_nonblocking(true).is_ok() {
+                        sockets.push(socket);
                     }
                 } else {
                     println!("Warning: Could not bind to interface {:?}, skipping", theip);
@@ -253,6 +605,52 @@ fn send_pattern(pat: Pattern) {
         }
     }
 
+    // devices ack once the pattern is running, resend until enough of them have
+    // repeats are cheap on the device, it drops them without parsing
+    let mut acked: HashSet<u32> = HashSet::new();
+    for _ in 0..MAX_SENDS {
+        for socket in &sockets {
+            if let Ok(amt) = socket.send_to(buf.as_slice(), "239.3.6.9:3690") {
+                if amt != buf.len() {
+                    println!("Warning: Did not send the full packet on {:?}, skipping", socket.local_addr());
+                }
+            } else {
+                println!("Warning: Failed to send on {:?}, skipping", socket.local_addr());
+            }
+        }
+
+        let deadline = Instant::now() + ACK_WAIT;
+        while expect.map_or(true, |n| acked.len() < n) && Instant::now() < deadline {
+            let mut ack = [0u8; ACK_LEN];
+            let mut got = false;
+            for socket in &sockets {
+                if let Ok((amt, _)) = socket.recv_from(&mut ack) {
+                    got = true;
+                    if amt == ACK_LEN && &ack[0..2] == seq && &ack[2..6] == hash {
+                        acked.insert(u32::from_le_bytes([ack[6], ack[7], ack[8], ack[9]]));
+                    }
+                }
+            }
+            if !got {
+                thread::sleep(Duration::from_millis(5));
+            }
+        }
+
+        if expect.map_or(false, |n| acked.len() >= n) {
+            break;
+        }
+    }
+
+    let mut ids: Vec<&u32> = acked.iter().collect();
+    ids.sort();
+    for id in ids {
+        println!("Acked by {:06x}", id);
+    }
+
+    match expect {
+        Some(n) if acked.len() < n => println!("Warning: Only {} of {} devices acked", acked.len(), n),
+        _ => println!("Acked by {} devices", acked.len()),
+    }
 }
 
 fn get_test_pat() -> Pattern {
@@ -296,6 +694,8 @@ fn get_test_pat() -> Pattern {
                 ],
             }
         ),
+        map: PixelMap::Strip,
+        seq: 0,
     }
 }
 
@@ -304,9 +704,15 @@ fn main() {
 
     let input_file: String = fs::read_to_string(&args[1]).unwrap();
 
-    let pat: Pattern = serde_json::from_str(&input_file).expect("Invalid json");
+    // how many devices to wait on acks from, without it every resend goes out
+    let expect: Option<usize> = args.get(2).map(|n| n.parse().expect("Invalid device count"));
+
+    let mut pat: Pattern = serde_json::from_str(&input_file).expect("Invalid json");
+
+    // only has to differ from the last pattern the devices got
+    pat.seq = SystemTime::now().duration_since(UNIX_EPOCH).unwrap().as_millis() as u16;
 
-    send_pattern(pat);
+    send_pattern(pat, expect);
 
     println!("Done");
 }
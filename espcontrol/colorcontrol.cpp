@@ -4,8 +4,32 @@
 #include "dbg.h"
 
 #include <Arduino.h>
+#include <math.h>
+
+#define LERP_SHIFT  12  // fractional bits used when lerping whole lines
+#define RACER_MAX_DT 32 // longest step racers take at once, keeps the fixed point math in range
+
+// where each channel goes in a wire pixel, same as the strip works it out from its type
+#define PX_R_OFF    ((PX_TYPE >> 4) & 0b11)
+#define PX_G_OFF    ((PX_TYPE >> 2) & 0b11)
+#define PX_B_OFF    (PX_TYPE & 0b11)
+// our color struct is laid out g, r, b
+#define PX_WIRE_GRB (PX_R_OFF == 1 && PX_G_OFF == 0 && PX_B_OFF == 2)
+
+#define LAYOUT_CELLS (LAYOUT_GRID * LAYOUT_GRID)
+
+#define GOV_AVG_SHIFT   3       // frame cost is averaged over about 8 frames
+#define GOV_SETTLE      8       // frames to wait after a change before another
+#define GOV_CALM        (1000 / REFRESH_DELAY)  // frames with headroom before giving work back
+
+#define FNV_OFFSET  0x811c9dc5
+#define FNV_PRIME   0x01000193
 
 static void randgrad(cctx_palette* colors, cctx_gradient* grad, uint16_t numpts, uint16_t len);
+static void render_grad(cctx_gradient* grad, color16* colorarr, uint16_t numpx);
+static void randcolor(cctx_palette* colors, color* out);
+static inline void widen_color(color* c, color16* out);
+static uint16_t render_frame(color_context* ctx, color* out, uint16_t deltat, bool* changed);
 
 static bool parse_gradient(pattern_gradient* data, uint16_t len, cctx_gradient* out, uint8_t** next) {
     if (len < sizeof(pattern_gradient)) {
@@ -205,6 +229,286 @@ static bool parse_poppingpkt(pattern_popping* data, uint16_t len, color_context*
     return true;
 }
 
+static bool check_vmcode(pattern_vmop* code, uint16_t len) {
+    // everything the interpreter trusts gets checked here, so it doesn't need to check anything per op
+    for (uint16_t i = 0; i < len; i++) {
+        pattern_vmop* op = &code[i];
+
+        if (op->op >= VM_NUM_OPS) {
+            dbgf("Unknown vm op %d at %d\n", op->op, i);
+            return false;
+        }
+        if (op->a >= VM_NUM_REGS) {
+            dbgf("Bad vm register %d at %d\n", op->a, i);
+            return false;
+        }
+
+        if (op->op == VM_LDI || op->op == VM_LDHI || op->op == VM_ADDI) {
+            // b and c are an immediate
+            continue;
+        }
+        else if (op->op == VM_JMP) {
+            // can land on the halt we add at the end, but no further, and never backwards
+            if (((uint32_t)i) + 1 + (uint16_t)(op->b | (op->c << 8)) > len) {
+                dbgf("Bad vm jump at %d\n", i);
+                return false;
+            }
+        }
+        else if (op->op == VM_JZ) {
+            if (((uint32_t)i) + 1 + op->b > len) {
+                dbgf("Bad vm jump at %d\n", i);
+                return false;
+            }
+        }
+        else if (op->b >= VM_NUM_REGS || op->c >= VM_NUM_REGS) {
+            dbgf("Bad vm register %d %d at %d\n", op->b, op->c, i);
+            return false;
+        }
+    }
+
+    return true;
+}
+
+static bool parse_programpkt(pattern_program* data, uint16_t len, color_context* ctx) {
+    dbgl("Parsing program packet");
+    if (len < sizeof(pattern_program)) {
+        dbgf("Tried to parse packet smaller than min pattern_program: %d\n", len);
+        return false;
+    }
+
+    uint16_t framelen = data->framelen;
+    uint16_t pixellen = data->pixellen;
+    if (framelen > VM_MAX_OPS || pixellen > VM_MAX_OPS) {
+        dbgf("Tried to parse program that is too long: %d %d\n", framelen, pixellen);
+        return false;
+    }
+
+    uint8_t* cursor = (uint8_t*)(&data->data);
+    uint8_t* end = ((uint8_t*)data) + len;
+    uint16_t codesz = (framelen + pixellen) * sizeof(pattern_vmop);
+
+    if ((cursor + codesz) > end) {
+        dbgf("Tried to parse program pkt but the code didn't fit: %d %d %d\n", framelen, pixellen, len);
+        return false;
+    }
+
+    pattern_vmop* frameops = (pattern_vmop*)cursor;
+    pattern_vmop* pixelops = frameops + framelen;
+    if (!check_vmcode(frameops, framelen) || !check_vmcode(pixelops, pixellen)) {
+        return false;
+    }
+    cursor += codesz;
+
+    cctx_gradient grad;
+    if (!parse_gradient((pattern_gradient*)cursor, (uint16_t)(end - cursor), &grad, &cursor)) {
+        return false;
+    }
+
+    pattern_palette* pal = (pattern_palette*)cursor;
+    if ((cursor + sizeof(pattern_palette)) > end ||
+        (cursor + sizeof(pattern_palette) + (pal->count * sizeof(pattern_colorrange))) != end) {
+        dbgf("Tried to parse program pkt but the palette sizes didn't match up: %d\n", len);
+        delete[] grad.pts;
+        return false;
+    }
+
+    // each program gets a halt on the end, so running off the end (or jumping to it) stops
+    pattern_vmop* code = new pattern_vmop[framelen + pixellen + 2];
+    memcpy(code, frameops, framelen * sizeof(pattern_vmop));
+    code[framelen] = {VM_HALT, 0, 0, 0};
+    memcpy(&code[framelen + 1], pixelops, pixellen * sizeof(pattern_vmop));
+    code[framelen + 1 + pixellen] = {VM_HALT, 0, 0, 0};
+
+    // the gradient never moves, so just look it up by pixel when running
+    color16* lut = new color16[NUM_PX]();
+    render_grad(&grad, lut, NUM_PX);
+    delete[] grad.pts;
+
+    uint16_t count = pal->count;
+    pattern_colorrange* colors = new pattern_colorrange[count];
+    for (uint16_t i = 0; i < count; i++) {
+        colors[i] = pal->ranges[i];
+    }
+
+    ctx->program.duration = data->duration;
+    ctx->program.framelen = framelen;
+    ctx->program.pixellen = pixellen;
+    ctx->program.code = code;
+    ctx->program.gradient = lut;
+    ctx->program.colors.count = count;
+    ctx->program.colors.ranges = colors;
+    ctx->program.t = 0;
+
+    return true;
+}
+
+static bool parse_racerpkt(pattern_racer* data, uint16_t len, color_context* ctx) {
+    dbgl("Parsing racer packet");
+    if (len < sizeof(pattern_racer)) {
+        dbgf("Tried to parse packet smaller than min pattern_racer: %d\n", len);
+        return false;
+    }
+
+    uint16_t count = data->colors.count;
+    pattern_colorrange* cursor = (pattern_colorrange*)(&data->colors.ranges);
+    uint8_t* end = ((uint8_t*)data) + len;
+
+    if ((((uint8_t*)cursor) + (count * sizeof(pattern_colorrange))) != end) {
+        dbgf("Tried to parse racer pkt but the sizes didn't match up: %d %d\n", count, len);
+        return false;
+    }
+
+    uint16_t num = data->count;
+    if (num > MAX_RACERS) {
+        num = MAX_RACERS;
+    }
+
+    cctx_racer* rc = &ctx->racer;
+    rc->count = num;
+    rc->pos = new int32_t[num];
+    rc->vel = new int32_t[num];
+    rc->acc = new int32_t[num];
+    rc->c = new color[num]();
+    rc->line = new color16[NUM_PX];
+
+    rc->speed_limit = ((int32_t)data->speed_limit) << 8;
+    if (rc->speed_limit == 0) {
+        // no point going faster than the whole strip in a frame
+        rc->speed_limit = ((int32_t)NUM_PX) << 16;
+    }
+    rc->trail = data->trail;
+    rc->edge = data->edge;
+    widen_color(&data->bg, &rc->bg);
+
+    for (uint16_t i = 0; i < NUM_PX; i++) {
+        rc->line[i] = rc->bg;
+    }
+
+    // the palette is only needed to pick each racer's color
+    cctx_palette colors;
+    colors.count = count;
+    colors.ranges = cursor;
+
+    for (uint16_t i = 0; i < num; i++) {
+        rc->pos[i] = random(0, ((int32_t)(NUM_PX - 1)) << 16);
+        // speeds can be negative, so 8.8 to 16.16 is a multiply, not a shift
+        rc->vel[i] = ((int32_t)random(data->speed_min, ((int32_t)data->speed_max) + 1)) * 256;
+        rc->acc[i] = random(data->accel_min, ((int32_t)data->accel_max) + 1);
+        if (count != 0) {
+            randcolor(&colors, &rc->c[i]);
+        }
+    }
+
+    return true;
+}
+
+static inline uint32_t fnv_step(uint32_t h, uint8_t b) {
+    return (h ^ b) * FNV_PRIME;
+}
+
+bool check_packet(uint8_t* data, uint16_t len, uint16_t* seq, uint32_t* hash) {
+    if (len < offsetof(pattern, grad)) {
+        dbgf("Tried to check packet smaller than min pattern: %d\n", len);
+        return false;
+    }
+
+    pattern* pat = (pattern*)data;
+
+    // hash everything but the hash field, which counts as zeros
+    uint16_t hstart = offsetof(pattern, hash);
+    uint16_t hend = hstart + sizeof(pat->hash);
+    uint32_t h = FNV_OFFSET;
+    uint16_t i = 0;
+    for (; i < hstart; i++) {
+        h = fnv_step(h, data[i]);
+    }
+    for (; i < hend; i++) {
+        h = fnv_step(h, 0);
+    }
+    for (; i < len; i++) {
+        h = fnv_step(h, data[i]);
+    }
+
+    if (h != pat->hash) {
+        dbgf("Packet hash didn't match: %x %x\n", h, pat->hash);
+        return false;
+    }
+
+    *seq = pat->seq;
+    *hash = h;
+    return true;
+}
+
+static bool parse_layerspkt(pattern_layers* data, uint16_t len, color_context* ctx) {
+    dbgl("Parsing layers packet");
+    if (len < sizeof(pattern_layers)) {
+        dbgf("Tried to parse packet smaller than min pattern_layers: %d\n", len);
+        return false;
+    }
+
+    uint8_t count = data->count;
+    if (count > MAX_LAYERS) {
+        dbgf("Tried to parse layers pkt with too many layers: %d\n", count);
+        return false;
+    }
+
+    uint8_t* cursor = (uint8_t*)(&data->data);
+    uint8_t* end = ((uint8_t*)data) + len;
+    uint8_t i;
+
+    ctx->layers.count = 0;
+    ctx->layers.base_count = 0;
+    ctx->layers.shed = 0;
+    memset(ctx->layers.top, 0, sizeof(ctx->layers.top));
+
+    for (i = 0; i < count; i++) {
+        pattern_layer* pl = (pattern_layer*)cursor;
+        if ((cursor + sizeof(pattern_layer)) > end || (cursor + sizeof(pattern_layer) + pl->len) > end) {
+            dbgf("Got past end while parsing layers\n");
+            goto endclean;
+        }
+
+        if (pl->len >= offsetof(pattern, grad) && ((pattern*)pl->pat)->type == PATTERN_TYPE_LAYERS) {
+            dbgl("Layers can't hold more layers");
+            goto endclean;
+        }
+
+        color_context* sub = new color_context();
+        if (!parse_packet(pl->pat, pl->len, sub)) {
+            delete sub;
+            goto endclean;
+        }
+        // the stack blends in 8.8 and dithers once at the end, so the layer doesn't drop to 8 bits
+        sub->line16 = new color16[NUM_PX]();
+
+        cctx_layer* l = &ctx->layers.layers[i];
+        l->blend = pl->blend;
+        l->opacity = pl->opacity;
+        l->ctx = sub;
+        l->wait = 0;
+        l->since = 0;
+        ctx->layers.count = i + 1;
+
+        cursor += sizeof(pattern_layer) + pl->len;
+    }
+
+    if (cursor != end) {
+        dbgf("Tried to parse layers pkt but the sizes didn't match up: %d\n", len);
+        goto endclean;
+    }
+
+    return true;
+
+endclean:
+    for (i = 0; i < ctx->layers.count; i++) {
+        destroyctx(ctx->layers.layers[i].ctx);
+        delete ctx->layers.layers[i].ctx;
+    }
+    ctx->layers.count = 0;
+
+    return false;
+}
+
 bool parse_packet(uint8_t* data, uint16_t len, color_context* ctx) {
     if (len < offsetof(pattern, grad)) {
         dbgf("Tried to parse packet smaller than min pattern: %d\n", len);
@@ -221,23 +525,167 @@ bool parse_packet(uint8_t* data, uint16_t len, color_context* ctx) {
 
     ctx->timeout = pat->timeout;
     ctx->type = type;
+    memset(ctx->dither, 0, sizeof(ctx->dither));
+    memset(ctx->frame, 0, sizeof(ctx->frame));
+    ctx->drawn = false;
+    ctx->shed = 0;
+    ctx->map = pat->map;
+    ctx->logical = NULL;
+    ctx->line16 = NULL;
+
+    // layers are mapped layer by layer, the stack itself just composites
+    if (type == PATTERN_TYPE_LAYERS) {
+        ctx->map = MAP_STRIP;
+    }
+
+    if (ctx->map > MAP_GRID) {
+        dbgf("Unknown pixel map: %d\n", ctx->map);
+        return false;
+    }
+
+    if (ctx->map == MAP_GRID && type != PATTERN_TYPE_POPPING) {
+        dbgf("Only popping can use the grid map, not type %d\n", type);
+        return false;
+    }
 
+    if (ctx->map == MAP_GRID) {
+        ctx->logical = new color[LAYOUT_CELLS]();
+    }
+    else if (ctx->map != MAP_STRIP) {
+        ctx->logical = new color[NUM_PX]();
+    }
+
+    bool ok = false;
     if (type == PATTERN_TYPE_GRADIENT) {
-        return parse_gradientpkt(&pat->grad, len - offsetof(pattern, grad), ctx);
+        ok = parse_gradientpkt(&pat->grad, len - offsetof(pattern, grad), ctx);
     }
     else if (type == PATTERN_TYPE_ANIGRADIENT) {
-        return parse_anigradientpkt(&pat->anigrad, len - offsetof(pattern, anigrad), ctx);
+        ok = parse_anigradientpkt(&pat->anigrad, len - offsetof(pattern, anigrad), ctx);
     }
     else if (type == PATTERN_TYPE_RANDGRADIENT) {
-        return parse_randgradientpkt(&pat->rndgrad, len - offsetof(pattern, rndgrad), ctx);
+        ok = parse_randgradientpkt(&pat->rndgrad, len - offsetof(pattern, rndgrad), ctx);
     }
     else if (type == PATTERN_TYPE_POPPING) {
-        return parse_poppingpkt(&pat->pop, len - offsetof(pattern, pop), ctx);
+        ok = parse_poppingpkt(&pat->pop, len - offsetof(pattern, pop), ctx);
+    }
+    else if (type == PATTERN_TYPE_PROGRAM) {
+        ok = parse_programpkt(&pat->prog, len - offsetof(pattern, prog), ctx);
+    }
+    else if (type == PATTERN_TYPE_RACER) {
+        ok = parse_racerpkt(&pat->racer, len - offsetof(pattern, racer), ctx);
+    }
+    else if (type == PATTERN_TYPE_LAYERS) {
+        ok = parse_layerspkt(&pat->layers, len - offsetof(pattern, layers), ctx);
+    }
+    else if (type == PATTERN_TYPE_LAYOUT) {
+        dbgl("Layouts go to parse_layout, not parse_packet");
     }
     else {
         dbgf("Unknown pattern type: %d\n", type);
     }
-    return false;
+
+    if (!ok) {
+        delete[] ctx->logical;
+        ctx->logical = NULL;
+    }
+    return ok;
+}
+
+// spreads v from lo..hi over the logical pixels
+static uint16_t layout_index(float v, float lo, float hi) {
+    if (hi - lo < 0.0001f) {
+        return 0;
+    }
+    int32_t i = (int32_t)(((v - lo) / (hi - lo)) * (NUM_PX - 1) + 0.5f);
+    if (i < 0) {
+        return 0;
+    }
+    if (i >= NUM_PX) {
+        return NUM_PX - 1;
+    }
+    return (uint16_t)i;
+}
+
+bool parse_layout(uint8_t* data, uint16_t len, px_layout* out) {
+    dbgl("Parsing layout packet");
+    if (len < offsetof(pattern, layout) + sizeof(pattern_layout)) {
+        dbgf("Tried to parse packet smaller than min pattern_layout: %d\n", len);
+        return false;
+    }
+
+    pattern* pat = (pattern*)data;
+    pattern_layout* pl = &pat->layout;
+
+    if (pat->type != PATTERN_TYPE_LAYOUT) {
+        dbgf("Tried to parse a layout out of type %d\n", pat->type);
+        return false;
+    }
+
+    if (pl->count != NUM_PX) {
+        dbgf("Layout has %d points but there are %d pixels\n", pl->count, NUM_PX);
+        return false;
+    }
+
+    if ((offsetof(pattern, layout) + sizeof(pattern_layout) + (pl->count * sizeof(pl->pts[0]))) != len) {
+        dbgf("Tried to parse layout pkt but the sizes didn't match up: %d\n", len);
+        return false;
+    }
+
+    // the float math only happens here, the frames just look up the results
+    float dir = (pl->dir * (2.0f * (float)M_PI)) / 65536.0f;
+    float dx = cosf(dir);
+    float dy = sinf(dir);
+    float along[NUM_PX];
+    float dist[NUM_PX];
+    float lo = 0, hi = 0, far = 0;
+    int16_t minx = pl->pts[0].x, maxx = minx;
+    int16_t miny = pl->pts[0].y, maxy = miny;
+
+    for (uint16_t i = 0; i < NUM_PX; i++) {
+        float x = (float)(pl->pts[i].x - pl->cx);
+        float y = (float)(pl->pts[i].y - pl->cy);
+
+        along[i] = (x * dx) + (y * dy);
+        dist[i] = sqrtf((x * x) + (y * y));
+
+        if (i == 0 || along[i] < lo) {
+            lo = along[i];
+        }
+        if (i == 0 || along[i] > hi) {
+            hi = along[i];
+        }
+        if (dist[i] > far) {
+            far = dist[i];
+        }
+        minx = (pl->pts[i].x < minx) ? pl->pts[i].x : minx;
+        maxx = (pl->pts[i].x > maxx) ? pl->pts[i].x : maxx;
+        miny = (pl->pts[i].y < miny) ? pl->pts[i].y : miny;
+        maxy = (pl->pts[i].y > maxy) ? pl->pts[i].y : maxy;
+
+        // angle from dir, 0 up to a full turn, wrapping back to pixel 0
+        float a = atan2f(y, x) - dir;
+        while (a < 0) {
+            a += 2.0f * (float)M_PI;
+        }
+        uint16_t ai = (uint16_t)((a * NUM_PX) / (2.0f * (float)M_PI));
+        out->lut[MAP_ANGULAR - 1][i] = (ai >= NUM_PX) ? 0 : ai;
+    }
+
+    // the grid is square, so the longer side sets the scale and circles stay round
+    float ext = (float)(((maxx - minx) > (maxy - miny)) ? (maxx - minx) : (maxy - miny));
+    float scale = (ext > 0) ? ((LAYOUT_GRID - 1) / ext) : 0;
+
+    for (uint16_t i = 0; i < NUM_PX; i++) {
+        out->lut[MAP_LINEAR - 1][i] = layout_index(along[i], lo, hi);
+        out->lut[MAP_RADIAL - 1][i] = layout_index(dist[i], 0, far);
+
+        uint8_t gx = (uint8_t)(((pl->pts[i].x - minx) * scale) + 0.5f);
+        uint8_t gy = (uint8_t)(((pl->pts[i].y - miny) * scale) + 0.5f);
+        out->cell[i] = (gy * LAYOUT_GRID) + gx;
+    }
+
+    out->hash = pat->hash;
+    return true;
 }
 
 
@@ -263,6 +711,31 @@ static void lerp_color(color* c1, color* c2, color* out, uint16_t step, uint16_t
     out->b = (uint8_t)(c1b + db);
 }
 
+// fraction of step/len in LERP_SHIFT bits
+// work it out once so a whole line can be lerped without a divide per pixel
+static uint16_t lerp_frac(uint16_t step, uint16_t len) {
+    if (len == 0 || step >= len) {
+        return 1 << LERP_SHIFT;
+    }
+    return (uint16_t)((((uint32_t)step) << LERP_SHIFT) / len);
+}
+
+static void lerp_color16(color16* c1, color16* c2, color16* out, uint16_t frac) {
+    int32_t dg = ((int32_t)c2->g) - c1->g;
+    int32_t dr = ((int32_t)c2->r) - c1->r;
+    int32_t db = ((int32_t)c2->b) - c1->b;
+
+    out->g = (uint16_t)(c1->g + ((dg * frac) >> LERP_SHIFT));
+    out->r = (uint16_t)(c1->r + ((dr * frac) >> LERP_SHIFT));
+    out->b = (uint16_t)(c1->b + ((db * frac) >> LERP_SHIFT));
+}
+
+static inline void widen_color(color* c, color16* out) {
+    out->g = ((uint16_t)c->g) << 8;
+    out->r = ((uint16_t)c->r) << 8;
+    out->b = ((uint16_t)c->b) << 8;
+}
+
 static void randcolor(cctx_palette* colors, color* out) {
     uint16_t i = random(0, colors->count);
     lerp_color(&colors->ranges[i].c1, &colors->ranges[i].c2, out, random(0, 0x41), 0x40);
@@ -290,7 +763,7 @@ static void randgrad(cctx_palette* colors, cctx_gradient* grad, uint16_t numpts,
     grad->count = numpts;
 }
 
-static void render_grad(cctx_gradient* grad, color* colorarr, uint16_t numpx) {
+static void render_grad(cctx_gradient* grad, color16* colorarr, uint16_t numpx) {
     // renders the gradient to the colorarr
     if (grad->count == 0) {
         return;
@@ -298,13 +771,12 @@ static void render_grad(cctx_gradient* grad, color* colorarr, uint16_t numpx) {
 
     pattern_gradpoint p1 = grad->pts[0];
     pattern_gradpoint p2;
-    color pointcolor;
     int16_t cur = 0;
     uint16_t seglen;
 
     // first just flood fill up to the first point
-    while (cur <= p1.n) {
-        colorarr[cur] = p1.c;
+    while (cur <= p1.n && cur < numpx) {
+        widen_color(&p1.c, &colorarr[cur]);
         cur++;
     }
 
@@ -313,20 +785,36 @@ static void render_grad(cctx_gradient* grad, color* colorarr, uint16_t numpx) {
         p2 = grad->pts[i];
         seglen = p2.n - p1.n;
 
-        while (cur < p2.n) {
-            if (cur >= numpx) {
-                return;
-            }
+        if (cur < p2.n) {
+            // step each channel across the segment in 8.16, so no divide per pixel
+            // falling segments are negative, so scale by multiplying rather than shifting
+            int32_t dg = ((((int32_t)p2.c.g) - p1.c.g) * 65536) / seglen;
+            int32_t dr = ((((int32_t)p2.c.r) - p1.c.r) * 65536) / seglen;
+            int32_t db = ((((int32_t)p2.c.b) - p1.c.b) * 65536) / seglen;
+
+            int32_t off = cur - p1.n;
+            int32_t g = (((int32_t)p1.c.g) << 16) + (dg * off);
+            int32_t r = (((int32_t)p1.c.r) << 16) + (dr * off);
+            int32_t b = (((int32_t)p1.c.b) << 16) + (db * off);
+
+            while (cur < p2.n) {
+                if (cur >= numpx) {
+                    return;
+                }
 
-            // instead of using normal lerp, we could optimize the steps for each channel across the line
-            lerp_color(&p1.c, &p2.c, &pointcolor, cur - p1.n, seglen);
-            colorarr[cur] = pointcolor;
-            cur++;
+                colorarr[cur].g = (uint16_t)(g >> 8);
+                colorarr[cur].r = (uint16_t)(r >> 8);
+                colorarr[cur].b = (uint16_t)(b >> 8);
+                g += dg;
+                r += dr;
+                b += db;
+                cur++;
+            }
         }
 
         if (cur < numpx) {
             // fill true color for the point
-            colorarr[cur] = p2.c;
+            widen_color(&p2.c, &colorarr[cur]);
             cur++;
         } else {
             return;
@@ -338,25 +826,569 @@ static void render_grad(cctx_gradient* grad, color* colorarr, uint16_t numpx) {
     // flood fill past the last point
 
     while (cur < numpx) {
-        colorarr[cur] = p1.c;
+        widen_color(&p1.c, &colorarr[cur]);
         cur++;
     }
 }
 
-static void write_colors(Adafruit_NeoPixel* px, color* colorarr, uint16_t numpx) {
-    for (uint16_t i = 0; i < numpx; i++, colorarr++) {
-        px->setPixelColor(i, colorarr->r, colorarr->g, colorarr->b);
+static inline uint8_t dither_channel(uint16_t v, uint8_t* resid) {
+    uint32_t acc = ((uint32_t)v) + *resid;
+    if (acc > 0xffff) {
+        *resid = 0;
+        return 0xff;
     }
+    *resid = (uint8_t)(acc & 0xff);
+    return (uint8_t)(acc >> 8);
 }
 
-uint16_t get_frame(Adafruit_NeoPixel* px, color_context* ctx, uint16_t deltat) {
-    color line1[NUM_PX];
-    color line2[NUM_PX];
+static void write_colors16(color* out, color16* colorarr, color* resid, uint16_t numpx) {
+    // drops down to the strip's 8 bits, but carries what got cut off into the next frame
+    // so over a few frames a dim slow fade averages out to the in between levels instead of stair stepping
+    if (resid == NULL) {
+        // no dithering, just round
+        for (uint16_t i = 0; i < numpx; i++, colorarr++, out++) {
+            out->g = (colorarr->g >= 0xff80) ? 0xff : (uint8_t)((colorarr->g + 0x80) >> 8);
+            out->r = (colorarr->r >= 0xff80) ? 0xff : (uint8_t)((colorarr->r + 0x80) >> 8);
+            out->b = (colorarr->b >= 0xff80) ? 0xff : (uint8_t)((colorarr->b + 0x80) >> 8);
+        }
+        return;
+    }
+
+    for (uint16_t i = 0; i < numpx; i++, colorarr++, resid++, out++) {
+        out->g = dither_channel(colorarr->g, &resid->g);
+        out->r = dither_channel(colorarr->r, &resid->r);
+        out->b = dither_channel(colorarr->b, &resid->b);
+    }
+}
+
+static color* dither_buf(color_context* ctx) {
+    // dithering is the first thing to go when frames run long
+    return (ctx->shed >= GOV_SHED_QUALITY) ? NULL : ctx->dither;
+}
+
+static bool dithers(color_context* ctx) {
+    // a layer never dithers itself, the stack does that once for all of them
+    return ctx->line16 == NULL && dither_buf(ctx) != NULL;
+}
+
+static void emit(color_context* ctx, color* out, color16* line) {
+    // patterns finish with an 8.8 line of their logical pixels
+    if (ctx->line16 == NULL) {
+        write_colors16(out, line, dither_buf(ctx), NUM_PX);
+        return;
+    }
+
+    // a layer hands it to the stack as is, already gathered onto the leds
+    const px_layout* layout = ctx->layout;
+    if (ctx->map == MAP_STRIP || layout == NULL || layout->hash == 0) {
+        memcpy(ctx->line16, line, sizeof(color16) * NUM_PX);
+        return;
+    }
+
+    const uint16_t* lut = layout->lut[ctx->map - 1];
+    for (uint16_t i = 0; i < NUM_PX; i++) {
+        ctx->line16[i] = line[lut[i]];
+    }
+}
+
+static bool px_direct(Adafruit_NeoPixel* px) {
+    // getBrightness reports 255 when the strip isn't scaling at all
+    return PX_WIRE_GRB && px->getBrightness() == 255 && px->numPixels() >= NUM_PX;
+}
+
+static color* frame_buffer(Adafruit_NeoPixel* px, color_context* ctx) {
+    // our color is already in the strip's wire order, so when nothing needs converting
+    // render straight into the strip's buffer, and it is also where the last frame is kept
+    if (px_direct(px)) {
+        return (color*)px->getPixels();
+    }
+    return ctx->frame;
+}
+
+static void publish(Adafruit_NeoPixel* px, color_context* ctx) {
+    if (!px_direct(px)) {
+        // one pass to reorder and scale, same math as setPixelColor
+        uint8_t* wire = px->getPixels();
+        uint16_t br = ((uint16_t)px->getBrightness()) + 1;
+        color* c = ctx->frame;
+        for (uint16_t i = 0; i < NUM_PX; i++, c++, wire += 3) {
+            wire[PX_R_OFF] = (uint8_t)((c->r * br) >> 8);
+            wire[PX_G_OFF] = (uint8_t)((c->g * br) >> 8);
+            wire[PX_B_OFF] = (uint8_t)((c->b * br) >> 8);
+        }
+    }
+    px->show();
+}
+
+static inline uint16_t vm_clamp16(int32_t v) {
+    if (v < 0) {
+        return 0;
+    }
+    if (v > 0xffff) {
+        return 0xffff;
+    }
+    return (uint16_t)v;
+}
+
+static void vm_run(const pattern_vmop* op, int32_t* r, cctx_program* prog, color16* out) {
+    // threaded dispatch, every handler jumps straight to the handler for the next op
+    // the code was checked at parse, so registers and jumps are trusted here
+    static const void* const dispatch[VM_NUM_OPS] = {
+        &&op_halt, &&op_ldi, &&op_ldhi, &&op_addi, &&op_mov, &&op_add, &&op_sub,
+        &&op_mul, &&op_mulq, &&op_div, &&op_mod, &&op_and, &&op_or, &&op_xor,
+        &&op_shl, &&op_shr, &&op_min, &&op_max, &&op_abs, &&op_lt, &&op_tri,
+        &&op_rand, &&op_jmp, &&op_jz, &&op_grad, &&op_pal, &&op_rgb, &&op_scale,
+    };
+
+#define VM_NEXT()   goto *dispatch[(++op)->op]
+#define VM_IMM      ((int32_t)(int16_t)(op->b | (op->c << 8)))
+#define RA          r[op->a]
+#define RB          r[op->b]
+#define RC          r[op->c]
+
+    int32_t v;
+    uint16_t frac;
+    color16 c1, c2;
+
+    goto *dispatch[op->op];
+
+op_halt:
+    return;
+op_ldi:
+    RA = VM_IMM;
+    VM_NEXT();
+op_ldhi:
+    RA = (int32_t)((((uint32_t)RA) & 0xffff) | (((uint32_t)VM_IMM) << 16));
+    VM_NEXT();
+op_addi:
+    RA = (int32_t)(((uint32_t)RA) + ((uint32_t)VM_IMM));
+    VM_NEXT();
+op_mov:
+    RA = RB;
+    VM_NEXT();
+op_add:
+    // wrapping math is done unsigned, signed overflow isn't defined
+    RA = (int32_t)(((uint32_t)RB) + ((uint32_t)RC));
+    VM_NEXT();
+op_sub:
+    RA = (int32_t)(((uint32_t)RB) - ((uint32_t)RC));
+    VM_NEXT();
+op_mul:
+    RA = (int32_t)(((uint32_t)RB) * ((uint32_t)RC));
+    VM_NEXT();
+op_mulq:
+    RA = (int32_t)((((int64_t)RB) * RC) >> 16);
+    VM_NEXT();
+op_div:
+    // INT32_MIN / -1 doesn't fit, and traps on some cpus, so it wraps like the other ops
+    RA = (RC == 0) ? 0 : (RC == -1) ? (int32_t)(0 - (uint32_t)RB) : RB / RC;
+    VM_NEXT();
+op_mod:
+    RA = (RC == 0 || RC == -1) ? 0 : RB % RC;
+    VM_NEXT();
+op_and:
+    RA = RB & RC;
+    VM_NEXT();
+op_or:
+    RA = RB | RC;
+    VM_NEXT();
+op_xor:
+    RA = RB ^ RC;
+    VM_NEXT();
+op_shl:
+    RA = (int32_t)(((uint32_t)RB) << (RC & 31));
+    VM_NEXT();
+op_shr:
+    RA = RB >> (RC & 31);
+    VM_NEXT();
+op_min:
+    RA = (RB < RC) ? RB : RC;
+    VM_NEXT();
+op_max:
+    RA = (RB > RC) ? RB : RC;
+    VM_NEXT();
+op_abs:
+    RA = (RB < 0) ? (int32_t)(0 - (uint32_t)RB) : RB;
+    VM_NEXT();
+op_lt:
+    RA = (RB < RC);
+    VM_NEXT();
+op_tri:
+    v = RB & 0xffff;
+    RA = (v < 0x8000) ? (v << 1) : ((0xffff - v) << 1);
+    VM_NEXT();
+op_rand:
+    RA = random(0, 0x10000);
+    VM_NEXT();
+op_jmp:
+    op += (uint16_t)VM_IMM;
+    VM_NEXT();
+op_jz:
+    if (RA == 0) {
+        op += op->b;
+    }
+    VM_NEXT();
+op_grad:
+    v = RA;
+    if (v < 0) {
+        v = 0;
+    } else if (v >= NUM_PX) {
+        v = NUM_PX - 1;
+    }
+    *out = prog->gradient[v];
+    VM_NEXT();
+op_pal:
+    if (prog->colors.count != 0) {
+        pattern_colorrange* rg = &prog->colors.ranges[((uint32_t)RA) % prog->colors.count];
+        widen_color(&rg->c1, &c1);
+        widen_color(&rg->c2, &c2);
+        frac = vm_clamp16(RB) >> (16 - LERP_SHIFT);
+        lerp_color16(&c1, &c2, out, frac);
+    }
+    VM_NEXT();
+op_rgb:
+    out->g = vm_clamp16(RA);
+    out->r = vm_clamp16(RB);
+    out->b = vm_clamp16(RC);
+    VM_NEXT();
+op_scale:
+    v = RA;
+    if (v < 0) {
+        v = 0;
+    } else if (v > 0x10000) {
+        v = 0x10000;
+    }
+    out->g = (uint16_t)((((uint32_t)out->g) * v) >> 16);
+    out->r = (uint16_t)((((uint32_t)out->r) * v) >> 16);
+    out->b = (uint16_t)((((uint32_t)out->b) * v) >> 16);
+    VM_NEXT();
+
+#undef VM_NEXT
+#undef VM_IMM
+#undef RA
+#undef RB
+#undef RC
+}
+
+static void step_racers(cctx_racer* rc, uint16_t n, uint16_t deltat) {
+    // closed form over deltat frames, so skipped frames land in the same place
+    int32_t dt = deltat;
+    if (dt > RACER_MAX_DT) {
+        dt = RACER_MAX_DT;
+    }
+
+    int32_t* pos = rc->pos;
+    int32_t* vel = rc->vel;
+    int32_t* acc = rc->acc;
+    int32_t lim = rc->speed_limit;
+
+    // same as stepping a frame at a time, pos += vel then vel += acc, with vel held to the limit
+    // so up to k frames it is still speeding up, and after that it runs at the limit
+    for (uint16_t i = 0; i < n; i++) {
+        int32_t v = vel[i];
+        int32_t a = acc[i];
+        v = (v > lim) ? lim : v;
+        v = (v < -lim) ? -lim : v;
+
+        int32_t k = dt;
+        int32_t cap = (a > 0) ? lim : -lim;
+        if (a != 0) {
+            // frames before v + a * k would pass the limit
+            int32_t free = ((cap - v) / a) + 1;
+            k = (free < dt) ? free : dt;
+        }
+
+        pos[i] += (v * k) + ((a * ((k * (k - 1)) >> 1))) + (cap * (dt - k));
+        vel[i] = v;
+    }
+    // keep this loop flat with no branches so it vectorizes
+    for (uint16_t i = 0; i < n; i++) {
+        int32_t v = vel[i] + (acc[i] * dt);
+        v = (v > lim) ? lim : v;
+        v = (v < -lim) ? -lim : v;
+        vel[i] = v;
+    }
+
+    if (rc->edge == RACER_BOUNCE) {
+        // fold the position back into the strip, every fold turns it around
+        // acceleration turns with it, so the whole step is one straight run in unfolded space
+        int32_t len = ((int32_t)(NUM_PX - 1)) << 16;
+        int32_t len2 = len * 2;
+        for (uint16_t i = 0; i < n; i++) {
+            int32_t p = pos[i] % len2;
+            p = (p < 0) ? p + len2 : p;
+            bool back = p > len;
+            pos[i] = back ? len2 - p : p;
+            vel[i] = back ? -vel[i] : vel[i];
+            acc[i] = back ? -acc[i] : acc[i];
+        }
+    } else {
+        int32_t len = ((int32_t)NUM_PX) << 16;
+        for (uint16_t i = 0; i < n; i++) {
+            int32_t p = pos[i] % len;
+            pos[i] = (p < 0) ? p + len : p;
+        }
+    }
+}
+
+static inline void add_sat16(uint16_t* ch, uint32_t amt) {
+    uint32_t v = *ch + amt;
+    *ch = (v > 0xffff) ? 0xffff : (uint16_t)v;
+}
+
+static void render_racers(cctx_racer* rc, uint16_t n, uint16_t deltat) {
+    color16* line = rc->line;
+    color16 bg = rc->bg;
+
+    // fade the trails toward bg by trail^deltat
+    uint32_t keep = 0x100;
+    for (uint16_t i = 0; i < deltat && keep != 0; i++) {
+        keep = (keep * rc->trail) >> 8;
+    }
+    for (uint16_t i = 0; i < NUM_PX; i++) {
+        line[i].g = (uint16_t)(bg.g + (((((int32_t)line[i].g) - bg.g) * (int32_t)keep) >> 8));
+        line[i].r = (uint16_t)(bg.r + (((((int32_t)line[i].r) - bg.r) * (int32_t)keep) >> 8));
+        line[i].b = (uint16_t)(bg.b + (((((int32_t)line[i].b) - bg.b) * (int32_t)keep) >> 8));
+    }
+
+    // split each racer between the two pixels it sits between
+    // an 8 bit color times a weight out of 256 is already 8.8
+    for (uint16_t i = 0; i < n; i++) {
+        int32_t p = rc->pos[i];
+        uint16_t px0 = p >> 16;
+        uint16_t px1 = px0 + 1;
+        uint32_t w1 = (p >> 8) & 0xff;
+        uint32_t w0 = 0x100 - w1;
+        color c = rc->c[i];
+
+        if (px1 >= NUM_PX) {
+            px1 = (rc->edge == RACER_BOUNCE) ? px0 : 0;
+        }
+
+        add_sat16(&line[px0].g, c.g * w0);
+        add_sat16(&line[px0].r, c.r * w0);
+        add_sat16(&line[px0].b, c.b * w0);
+        add_sat16(&line[px1].g, c.g * w1);
+        add_sat16(&line[px1].r, c.r * w1);
+        add_sat16(&line[px1].b, c.b * w1);
+    }
+}
+
+// v scaled by s out of 255, exact at both ends
+static inline uint16_t scale16(uint16_t v, uint8_t s) {
+    return (uint16_t)((((uint32_t)v) * (((uint32_t)s) + 1)) >> 8);
+}
+
+static inline uint16_t lerp16(uint16_t a, uint16_t b, uint8_t t) {
+    return (b > a) ? (a + scale16(b - a, t)) : (a - scale16(a - b, t));
+}
+
+// the layers are blended in 8.8, so stacking dim layers doesn't throw away their low bits
+static inline uint16_t blend_channel(uint16_t d, uint16_t s, uint8_t mode, uint8_t opacity, uint8_t alpha) {
+    uint32_t v;
+    if (mode == LAYER_ADD) {
+        v = ((uint32_t)d) + scale16(s, opacity);
+        return (v > 0xffff) ? 0xffff : (uint16_t)v;
+    }
+    else if (mode == LAYER_MULTIPLY) {
+        // s out of 0xffff, exact at both ends the same way scale16 is
+        v = (((uint32_t)d) * (((uint32_t)s) + 1)) >> 16;
+        return lerp16(d, (uint16_t)v, opacity);
+    }
+    else if (mode == LAYER_MAX) {
+        return lerp16(d, (s > d) ? s : d, opacity);
+    }
+    // LAYER_OVER
+    return lerp16(d, s, alpha);
+}
+
+static void composite(color16* out, color16* base, cctx_layer* layers, uint8_t from, uint8_t to, uint8_t shed) {
+    // one pass over the strip, each pixel goes through every layer while it is in registers
+    for (uint16_t i = 0; i < NUM_PX; i++) {
+        color16 d;
+        if (base != NULL) {
+            d = base[i];
+        } else {
+            d = {0, 0, 0};
+        }
+
+        for (uint8_t j = from; j < to; j++) {
+            cctx_layer* l = &layers[j];
+            color16 s = l->ctx->line16[i];
+            uint8_t alpha = 0;
+            uint8_t mode = l->blend;
+
+            if (mode == LAYER_OVER && shed >= GOV_SHED_QUALITY) {
+                // max looks close enough for sparkles over a background, and skips the alpha
+                mode = LAYER_MAX;
+            }
+
+            if (mode == LAYER_OVER) {
+                // patterns don't have alpha, so the brightest channel is how solid the pixel is
+                // this lets a dark background show what is under it
+                uint16_t a = s.g;
+                a = (s.r > a) ? s.r : a;
+                a = (s.b > a) ? s.b : a;
+                alpha = (uint8_t)scale16(a >> 8, l->opacity);
+            }
+
+            d.g = blend_channel(d.g, s.g, mode, l->opacity, alpha);
+            d.r = blend_channel(d.r, s.r, mode, l->opacity, alpha);
+            d.b = blend_channel(d.b, s.b, mode, l->opacity, alpha);
+        }
+
+        out[i] = d;
+    }
+}
+
+static uint16_t render_layers(color_context* ctx, color* out, uint16_t deltat, bool* drew) {
+    cctx_layers* lc = &ctx->layers;
+    uint8_t lowest = lc->count;    // lowest layer that changed this frame
+    uint16_t nextframe = 0;
+
+    for (uint8_t i = 0; i < lc->count; i++) {
+        cctx_layer* l = &lc->layers[i];
+        l->since += deltat;
+
+        // layers that have nothing new keep their last line
+        if (!l->ctx->drawn || (l->wait != 0 && l->since >= l->wait)) {
+            bool ch;
+            l->ctx->shed = ctx->shed;
+            l->ctx->layout = ctx->layout;
+            l->wait = render_frame(l->ctx, l->ctx->frame, l->since, &ch);
+            l->since = 0;
+            if (ch && i < lowest) {
+                lowest = i;
+            }
+        }
+
+        if (l->wait != 0) {
+            uint16_t left = (l->since >= l->wait) ? 1 : l->wait - l->since;
+            if (nextframe == 0 || left < nextframe) {
+                nextframe = left;
+            }
+        }
+    }
+
+    if (lc->shed != ctx->shed) {
+        // over turns into max when shed, so nothing composited before still holds
+        lc->shed = ctx->shed;
+        lc->base_count = 0;
+        lowest = 0;
+    }
+
+    if (lowest != lc->count) {
+        // everything under the lowest change is baked into base, so steady frames only pay for the layers that move
+        if (lowest != lc->base_count) {
+            composite(lc->base, NULL, lc->layers, 0, lowest, lc->shed);
+            lc->base_count = lowest;
+        }
+
+        composite(lc->top, (lowest == 0) ? NULL : lc->base, lc->layers, lowest, lc->count, lc->shed);
+    }
+    else if (dither_buf(ctx) == NULL) {
+        // nothing moved, and what is out there is still right
+        *drew = false;
+        return nextframe;
+    }
+
+    // one drop to 8 bits for the whole stack
+    // with dithering on it keeps going out even when nothing moved, or it freezes on one snapshot
+    write_colors16(out, lc->top, dither_buf(ctx), NUM_PX);
+    if (dither_buf(ctx) != NULL) {
+        nextframe = 1;
+    }
+    return nextframe;
+}
+
+// reps is how many frames of growing to add at once, when frames are being stretched
+static void draw_spot(cctx_spot* spt, color* out, uint16_t reps) {
+    color mid;
+
+    // add it's growing
+    int16_t p = spt->pos;
+    int16_t o = spt->off;
+    int16_t n = p - o;
+    int16_t e = n + spt->sz;
+    for (; n < e; n++) {
+        
+        if (n < 0) {
+            continue;
+        }
+        if (n >= NUM_PX) {
+            break;
+        }
+
+        mid = out[n];
+
+        //TODO colors overflow here if background is bright enough
+        // it looks kind of cool, but should probably not happen
+        if (spt->type == SPOT_SOLID || o == 0) {
+            mid.g += spt->c.g * reps;
+            mid.r += spt->c.r * reps;
+            mid.b += spt->c.b * reps;
+        } else {
+            // need to feather to center
+            int16_t d = n - p;
+            if (d < 0) {
+                d = -d;
+            }
+
+            mid.g += spt->c.g * reps * d / o;
+            mid.r += spt->c.r * reps * d / o;
+            mid.b += spt->c.b * reps * d / o;
+        }
+
+        out[n] = mid;
+    }
+}
+
+static void draw_spot2d(cctx_spot* spt, color* grid, uint16_t reps) {
+    // same as the strip's spots, but a disc on the grid, only the cells under it get touched
+    int16_t px = spt->pos % LAYOUT_GRID;
+    int16_t py = spt->pos / LAYOUT_GRID;
+    int16_t o = spt->off;
+    int32_t o2 = o * o;
+
+    for (int16_t y = py - o; y <= py + o; y++) {
+        if (y < 0 || y >= LAYOUT_GRID) {
+            continue;
+        }
+        for (int16_t x = px - o; x <= px + o; x++) {
+            if (x < 0 || x >= LAYOUT_GRID) {
+                continue;
+            }
+
+            int32_t d2 = ((x - px) * (x - px)) + ((y - py) * (y - py));
+            if (d2 > o2) {
+                continue;
+            }
+
+            color* mid = &grid[(y * LAYOUT_GRID) + x];
+            if (spt->type == SPOT_SOLID || o == 0) {
+                mid->g += spt->c.g * reps;
+                mid->r += spt->c.r * reps;
+                mid->b += spt->c.b * reps;
+            } else {
+                // feathered on the squared distance, so no sqrt per cell
+                mid->g += spt->c.g * reps * d2 / o2;
+                mid->r += spt->c.r * reps * d2 / o2;
+                mid->b += spt->c.b * reps * d2 / o2;
+            }
+        }
+    }
+}
+
+static uint16_t render_pattern(color_context* ctx, color* out, uint16_t deltat, bool* changed) {
+    color16 line1[NUM_PX];
+    color16 line2[NUM_PX];
     color mid;
-    uint32_t clr;
     uint16_t nextframe = 0;
     uint16_t dur;
     uint16_t step;
+    bool drew = true;   // false when out is still good from last time
+
+    *changed = false;
 
     //TODO timeout
 
@@ -366,8 +1398,16 @@ uint16_t get_frame(Adafruit_NeoPixel* px, color_context* ctx, uint16_t deltat) {
         return 0;
     }
     else if (ctx->type == PATTERN_TYPE_GRADIENT) {
-        render_grad(&ctx->gradient, line1, NUM_PX);
-        write_colors(px, line1, NUM_PX);
+        if (ctx->drawn && !dithers(ctx)) {
+            drew = false;
+        } else {
+            render_grad(&ctx->gradient, line1, NUM_PX);
+            emit(ctx, out, line1);
+        }
+        if (dithers(ctx)) {
+            // dithering only shows the levels in between by changing frame to frame
+            nextframe = 1;
+        }
     }
     else if (ctx->type == PATTERN_TYPE_ANIGRADIENT) {
         // what are the two we are looking between
@@ -393,8 +1433,14 @@ uint16_t get_frame(Adafruit_NeoPixel* px, color_context* ctx, uint16_t deltat) {
             // either we only have one gradient
             // or step is zero,  or type is holdmeaning we don't have to blend with another frame
             // or blend type is hold, so no blending
-            render_grad(&ctx->anigradient.frames[f1].gradient, line1, NUM_PX);
-            write_colors(px, line1, NUM_PX);
+            if (ctx->drawn && !dithers(ctx) && (ctx->anigradient.framecount == 1 || step != 0)) {
+                // still showing this same gradient from last frame
+                // with dithering on it has to keep going out, or it freezes on one snapshot
+                drew = false;
+            } else {
+                render_grad(&ctx->anigradient.frames[f1].gradient, line1, NUM_PX);
+                emit(ctx, out, line1);
+            }
         }
         else {
             //TODO handle other blend types
@@ -403,10 +1449,11 @@ uint16_t get_frame(Adafruit_NeoPixel* px, color_context* ctx, uint16_t deltat) {
             render_grad(&ctx->anigradient.frames[f1].gradient, line1, NUM_PX);
             render_grad(&ctx->anigradient.frames[f2].gradient, line2, NUM_PX);
 
+            uint16_t frac = lerp_frac(step, dur);
             for (uint16_t i = 0; i < NUM_PX; i++) {
-                lerp_color(&line1[i], &line2[i], &mid, step, dur);
-                px->setPixelColor(i, mid.r, mid.g, mid.b);
+                lerp_color16(&line1[i], &line2[i], &line1[i], frac);
             }
+            emit(ctx, out, line1);
         }
 
         // add to step/frame
@@ -435,17 +1482,18 @@ uint16_t get_frame(Adafruit_NeoPixel* px, color_context* ctx, uint16_t deltat) {
 
             
             render_grad(&ctx->randgradient.frame1, line1, NUM_PX);
-            write_colors(px, line1, NUM_PX);
+            emit(ctx, out, line1);
         }
         else {
             // lerp
             render_grad(&ctx->randgradient.frame1, line1, NUM_PX);
             render_grad(&ctx->randgradient.frame2, line2, NUM_PX);
 
+            uint16_t frac = lerp_frac(step, dur);
             for (uint16_t i = 0; i < NUM_PX; i++) {
-                lerp_color(&line1[i], &line2[i], &mid, step, dur);
-                px->setPixelColor(i, mid.r, mid.g, mid.b);
+                lerp_color16(&line1[i], &line2[i], &line1[i], frac);
             }
+            emit(ctx, out, line1);
         }
 
         step += deltat;
@@ -454,17 +1502,28 @@ uint16_t get_frame(Adafruit_NeoPixel* px, color_context* ctx, uint16_t deltat) {
     else if (ctx->type == PATTERN_TYPE_POPPING) {
         nextframe = 1;
 
+        // everything below runs deltat frames worth at once, so stretched frames don't slow it down
+        // count the fades that would have happened in between
+        uint16_t fades = 0;
+        for (uint16_t t = 0; t < deltat; t++) {
+            if (ctx->popping.fadestep == 0) {
+                fades++;
+                ctx->popping.fadestep = ctx->popping.fadeskip;
+            } else {
+                ctx->popping.fadestep--;
+            }
+        }
+
         // fade frame (but don't go below bg)
-        if (ctx->popping.fadestep == 0) {
+        if (fades != 0) {
 
-            uint8_t fd = ctx->popping.fadeamt;
+            uint32_t fdw = (uint32_t)ctx->popping.fadeamt * fades;
+            uint8_t fd = (fdw > 0xff) ? 0xff : fdw;
             color bg = ctx->popping.bg;
+            uint16_t len = (ctx->map == MAP_GRID) ? LAYOUT_CELLS : NUM_PX;
 
-            for (uint16_t i = 0; i < NUM_PX; i++) {
-                clr = px->getPixelColor(i);
-                mid.b = clr & 0xff;
-                mid.g = (clr>>8) & 0xff;
-                mid.r = (clr>>16) & 0xff;
+            for (uint16_t i = 0; i < len; i++) {
+                mid = out[i];
 
                 // possible overflow if fd is too high
                 if (mid.g > (bg.g + fd)) {
@@ -483,103 +1542,73 @@ uint16_t get_frame(Adafruit_NeoPixel* px, color_context* ctx, uint16_t deltat) {
                     mid.b = bg.b;
                 }
 
-                px->setPixelColor(i, mid.r, mid.g, mid.b);
+                out[i] = mid;
             }
-
-            ctx->popping.fadestep = ctx->popping.fadeskip;
-        } else {
-            ctx->popping.fadestep--;
         }
 
-        // if we are due to pop one in, do that
+        // if we are due to pop one in, do that, once per frame that passed
         uint16_t next = ctx->popping.spots_next;
-        uint16_t pushnext = next + 1;
-        if (pushnext == MAX_SPOTS) {
-            pushnext = 0;
-        }
         uint16_t start = ctx->popping.spots_start;
-
         cctx_spot* spt;
-        if (ctx->popping.frametillspot == 0 && pushnext != start) {
-            spt = &ctx->popping.spots[next];
-            next = pushnext;
+        // when frames are running long, keep fewer spots going at once
+        uint16_t maxlive = MAX_SPOTS >> ctx->shed;
 
-            ctx->popping.frametillspot = random(ctx->popping.frametillspot_min, ctx->popping.frametillspot_max);
-            
-            spt->pos = random(0, NUM_PX+1);
+        for (uint16_t t = 0; t < deltat; t++) {
+            uint16_t pushnext = next + 1;
+            if (pushnext == MAX_SPOTS) {
+                pushnext = 0;
+            }
+            uint16_t live = (next >= start) ? (next - start) : (next + MAX_SPOTS - start);
 
-            // types
-            uint8_t sptype = (ctx->popping.spot_typeflags & (SPOT_FUZZ | SPOT_SOLID));
-            if (sptype == (SPOT_FUZZ | SPOT_SOLID)) {
-                if (random(0,0x100) & 0x1) {
-                    sptype = SPOT_FUZZ;
-                } else {
-                    sptype = SPOT_SOLID;
+            if (ctx->popping.frametillspot == 0 && pushnext != start && live < maxlive) {
+                spt = &ctx->popping.spots[next];
+                next = pushnext;
+
+                ctx->popping.frametillspot = random(ctx->popping.frametillspot_min, ctx->popping.frametillspot_max);
+            
+                spt->pos = random(0, (ctx->map == MAP_GRID) ? LAYOUT_CELLS : NUM_PX+1);
+
+                // types
+                uint8_t sptype = (ctx->popping.spot_typeflags & (SPOT_FUZZ | SPOT_SOLID));
+                if (sptype == (SPOT_FUZZ | SPOT_SOLID)) {
+                    if (random(0,0x100) & 0x1) {
+                        sptype = SPOT_FUZZ;
+                    } else {
+                        sptype = SPOT_SOLID;
+                    }
                 }
+                spt->type = sptype;
+
+                randcolor(&ctx->popping.colors, &spt->c);
+
+                spt->sz = random(ctx->popping.sizespot_min, ctx->popping.sizespot_max);
+                spt->off = spt->sz / 2;
+                spt->growtime = random(ctx->popping.growspot_min, ctx->popping.growspot_max);
+                // scale color by growtime
+                if (spt->growtime > 0) {
+                    spt->c.g /= spt->growtime;
+                    spt->c.r /= spt->growtime;
+                    spt->c.b /= spt->growtime;
+                }
+            } else if (ctx->popping.frametillspot != 0) {
+                ctx->popping.frametillspot--;
             }
-            spt->type = sptype;
-
-            randcolor(&ctx->popping.colors, &spt->c);
-
-            spt->sz = random(ctx->popping.sizespot_min, ctx->popping.sizespot_max);
-            spt->off = spt->sz / 2;
-            spt->growtime = random(ctx->popping.growspot_min, ctx->popping.growspot_max);
-            // scale color by growtime
-            if (spt->growtime > 0) {
-                spt->c.g /= spt->growtime;
-                spt->c.r /= spt->growtime;
-                spt->c.b /= spt->growtime;
-            }
-        } else if (ctx->popping.frametillspot != 0) {
-            ctx->popping.frametillspot--;
         }
 
         // grow spots and get rid of live ones
         for (uint16_t i = start; i != next; i = (i+1 >= MAX_SPOTS) ? 0 : i+1) {
             spt = &ctx->popping.spots[i];
 
-            // add it's growing
-            int16_t p = spt->pos;
-            int16_t o = spt->off;
-            int16_t n = p - o;
-            int16_t e = n + spt->sz;
-            for (; n < e; n++) {
-                
-                if (n < 0) {
-                    continue;
-                }
-                if (n >= NUM_PX) {
-                    break;
-                }
-
-                clr = px->getPixelColor(n);
-                mid.b = clr & 0xff;
-                mid.g = (clr>>8) & 0xff;
-                mid.r = (clr>>16) & 0xff;
-
-                //TODO colors overflow here if background is bright enough
-                // it looks kind of cool, but should probably not happen
-                if (spt->type == SPOT_SOLID || o == 0) {
-                    mid.g += spt->c.g;
-                    mid.r += spt->c.r;
-                    mid.b += spt->c.b;
-                } else {
-                    // need to feather to center
-                    int16_t d = n - p;
-                    if (d < 0) {
-                        d = -d;
-                    }
-
-                    mid.g += spt->c.g * d / o;
-                    mid.r += spt->c.r * d / o;
-                    mid.b += spt->c.b * d / o;
-                }
-
-                px->setPixelColor(n, mid.r, mid.g, mid.b);
-            } 
+            // it only has growtime+1 frames of growing left in it
+            uint16_t reps = (deltat > spt->growtime) ? spt->growtime + 1 : deltat;
+            if (ctx->map == MAP_GRID) {
+                draw_spot2d(spt, out, reps);
+            } else {
+                draw_spot(spt, out, reps);
+            }
 
             // clear this one if it is done
-            if (spt->growtime == 0) {
+            if (reps > spt->growtime) {
                 if (i != start) {
                     // gotta swap the live one into this spot
                     *spt = ctx->popping.spots[start];
@@ -592,24 +1621,215 @@ uint16_t get_frame(Adafruit_NeoPixel* px, color_context* ctx, uint16_t deltat) {
                 }
 
             } else {
-                spt->growtime--;
+                spt->growtime -= reps;
             }
         }
 
         ctx->popping.spots_start = start;
         ctx->popping.spots_next = next;
     }
+    else if (ctx->type == PATTERN_TYPE_PROGRAM) {
+        nextframe = 1;
+
+        cctx_program* prog = &ctx->program;
+        int32_t fregs[VM_NUM_REGS] = {};
+        int32_t pregs[VM_NUM_REGS];
+        color16 fc = {};
+
+        fregs[VM_REG_T] = (int32_t)prog->t;
+        if (prog->duration != 0) {
+            fregs[VM_REG_PHASE] = (int32_t)(((prog->t % prog->duration) << 16) / prog->duration);
+        }
+        fregs[VM_REG_NUMPX] = NUM_PX;
+
+        vm_run(prog->code, fregs, prog, &fc);
+
+        if (prog->pixellen == 0) {
+            for (uint16_t i = 0; i < NUM_PX; i++) {
+                line1[i] = fc;
+            }
+        }
+        else {
+            const pattern_vmop* pixcode = &prog->code[prog->framelen + 1];
+            for (uint16_t i = 0; i < NUM_PX; i++) {
+                memcpy(pregs, fregs, sizeof(pregs));
+                pregs[VM_REG_PX] = i;
+                line1[i] = fc;
+                vm_run(pixcode, pregs, prog, &line1[i]);
+            }
+        }
+
+        emit(ctx, out, line1);
+
+        prog->t += deltat;
+    }
+    else if (ctx->type == PATTERN_TYPE_RACER) {
+        nextframe = 1;
+
+        // when frames are running long, only move and draw some of them
+        uint16_t live = ctx->racer.count >> ctx->shed;
+
+        step_racers(&ctx->racer, live, deltat);
+        render_racers(&ctx->racer, live, deltat);
+        emit(ctx, out, ctx->racer.line);
+    }
+    else if (ctx->type == PATTERN_TYPE_LAYERS) {
+        nextframe = render_layers(ctx, out, deltat, &drew);
+    }
     else {
         dbgf("Unimplemented get_frame for type %d\n", ctx->type);
         return 0;
     }
 
-    px->show();
+    if (drew) {
+        *changed = true;
+        ctx->drawn = true;
+    }
     return nextframe;
 }
 
+static void gather(color_context* ctx, color* out) {
+    color* logical = ctx->logical;
+    const px_layout* layout = ctx->layout;
+    if (layout == NULL || layout->hash == 0) {
+        if (ctx->map == MAP_GRID) {
+            // the grid means nothing without a layout, so stay dark until one comes
+            memset(out, 0, sizeof(color) * NUM_PX);
+        } else {
+            // no layout yet, so the strip is all we know
+            memcpy(out, logical, sizeof(color) * NUM_PX);
+        }
+        return;
+    }
+
+    if (ctx->map == MAP_GRID) {
+        const uint8_t* cell = layout->cell;
+        for (uint16_t i = 0; i < NUM_PX; i++) {
+            out[i] = logical[cell[i]];
+        }
+        return;
+    }
+
+    const uint16_t* lut = layout->lut[ctx->map - 1];
+    for (uint16_t i = 0; i < NUM_PX; i++) {
+        out[i] = logical[lut[i]];
+    }
+}
+
+static uint16_t render_frame(color_context* ctx, color* out, uint16_t deltat, bool* changed) {
+    // popping builds on its last frame in 8 bits, so even as a layer it draws to out like always
+    bool draws8 = (ctx->line16 == NULL || ctx->type == PATTERN_TYPE_POPPING);
+    uint16_t nextframe;
+
+    if (ctx->logical == NULL) {
+        nextframe = render_pattern(ctx, out, deltat, changed);
+    } else {
+        // mapped patterns draw their own line, and keep it, since some build on last frame
+        nextframe = render_pattern(ctx, ctx->logical, deltat, changed);
+        if (*changed && draws8) {
+            gather(ctx, out);
+        }
+    }
+
+    if (*changed && draws8 && ctx->line16 != NULL) {
+        // then widened for the stack once it is on the leds
+        for (uint16_t i = 0; i < NUM_PX; i++) {
+            widen_color(&out[i], &ctx->line16[i]);
+        }
+    }
+    return nextframe;
+}
+
+uint16_t get_frame(Adafruit_NeoPixel* px, color_context* ctx, uint16_t deltat) {
+    bool changed;
+    uint16_t nextframe = render_frame(ctx, frame_buffer(px, ctx), deltat, &changed);
+
+    if (changed) {
+        publish(px, ctx);
+    }
+    return nextframe;
+}
+
+void layout_changed(color_context* ctx) {
+    ctx->drawn = false;
+    if (ctx->type == PATTERN_TYPE_LAYERS) {
+        // each layer keeps its own frame, and base is built from them
+        for (uint8_t i = 0; i < ctx->layers.count; i++) {
+            layout_changed(ctx->layers.layers[i].ctx);
+        }
+        ctx->layers.base_count = 0;
+    }
+}
+
+static uint16_t gov_stride(uint8_t level) {
+    // the first level only sheds quality, past that each level stretches out the frames
+    return (level <= GOV_SHED_QUALITY) ? 1 : level;
+}
+
+void governor_init(frame_governor* gov, uint32_t budget_us) {
+    memset(gov, 0, sizeof(*gov));
+    gov->budget_us = budget_us;
+}
+
+uint16_t governor_update(frame_governor* gov, uint32_t cost_us, uint16_t frame_sleep) {
+    gov->frames++;
+
+    if (frame_sleep == 0) {
+        // not animating, so nothing to keep up with, give it all back
+        // patterns can draw differently when shed, so a shed level has to be able to come back from here
+        if (gov->level != 0) {
+            gov->level = 0;
+            gov->recovers++;
+        }
+        gov->avg_us = 0;
+        gov->settle = 0;
+        gov->calm = 0;
+        return 0;
+    }
+
+    uint32_t budget = gov->budget_us * frame_sleep;
+    uint32_t slot = budget * gov_stride(gov->level);
+    if (cost_us > slot) {
+        gov->overruns++;
+    }
+
+    // smooth it, so one slow frame doesn't shed anything
+    gov->avg_us = (uint32_t)(((int32_t)gov->avg_us) + ((((int32_t)cost_us) - ((int32_t)gov->avg_us)) >> GOV_AVG_SHIFT));
+
+    if (gov->settle != 0) {
+        // give the last change a chance to show up in the average
+        gov->settle--;
+    }
+    else if (gov->level < GOV_MAX_LEVEL && gov->avg_us > (slot - (slot >> 3))) {
+        gov->level++;
+        gov->sheds++;
+        gov->settle = GOV_SETTLE;
+        gov->calm = 0;
+    }
+    else if (gov->level > 0 && gov->avg_us < ((budget * gov_stride(gov->level - 1)) >> 1)) {
+        // only come back once there has been plenty of room for a while
+        gov->calm++;
+        if (gov->calm >= GOV_CALM) {
+            gov->level--;
+            gov->recovers++;
+            gov->settle = GOV_SETTLE;
+            gov->calm = 0;
+        }
+    }
+    else {
+        gov->calm = 0;
+    }
+
+    return frame_sleep * gov_stride(gov->level);
+}
+
 // Doesn't free the ctx itself, just any members that need to be
 void destroyctx(color_context* ctx) {
+    delete[] ctx->logical;
+    ctx->logical = NULL;
+    delete[] ctx->line16;
+    ctx->line16 = NULL;
+
     if (ctx->type == PATTERN_TYPE_GRADIENT) {
         delete[] ctx->gradient.pts;
     }
@@ -629,6 +1849,24 @@ void destroyctx(color_context* ctx) {
         //TODO
         // palette
     }
+    else if (ctx->type == PATTERN_TYPE_RACER) {
+        delete[] ctx->racer.pos;
+        delete[] ctx->racer.vel;
+        delete[] ctx->racer.acc;
+        delete[] ctx->racer.c;
+        delete[] ctx->racer.line;
+    }
+    else if (ctx->type == PATTERN_TYPE_LAYERS) {
+        for (uint8_t i = 0; i < ctx->layers.count; i++) {
+            destroyctx(ctx->layers.layers[i].ctx);
+            delete ctx->layers.layers[i].ctx;
+        }
+    }
+    else if (ctx->type == PATTERN_TYPE_PROGRAM) {
+        delete[] ctx->program.code;
+        delete[] ctx->program.gradient;
+        delete[] ctx->program.colors.ranges;
+    }
     else {
         dbgf("Got destroy call for unknown ctx type %d\n", ctx->type);
     }
@@ -7,8 +7,21 @@
 #include <stdint.h>
 
 #define NUM_PX 109
+#define PX_TYPE     (NEO_GRB + NEO_KHZ800)
 #define MAX_SPOTS   (NUM_PX / 2)
 
+#define REFRESH_DELAY     18   // in ms
+#define LONG_DELAY        2700
+#define LONG_DELAY_FRAMES (LONG_DELAY / REFRESH_DELAY)
+
+// internal rendering color, each channel is 8.8 fixed point
+// only gets dropped to 8 bits when written out to the strip
+typedef struct {
+    uint16_t g;
+    uint16_t r;
+    uint16_t b;
+} color16;
+
 typedef struct {
     uint16_t count;
     pattern_gradpoint* pts;
@@ -74,6 +87,49 @@ typedef struct {
 } cctx_popping;
 
 typedef struct {
+    uint16_t duration;
+    uint16_t framelen;
+    uint16_t pixellen;
+    pattern_vmop* code;         // frame ops then pixel ops, each ended with an added VM_HALT
+    color16* gradient;          // rendered across the strip once at parse
+    cctx_palette colors;
+    uint32_t t;
+} cctx_program;
+
+// racers are kept as separate arrays so the physics loops run straight down each one
+typedef struct {
+    uint16_t count;
+    int32_t* pos;               // 16.16 pixels
+    int32_t* vel;               // 16.16 pixels per frame
+    int32_t* acc;               // 16.16 pixels per frame per frame
+    color* c;
+    int32_t speed_limit;        // 16.16 pixels per frame
+    uint8_t trail;
+    uint8_t edge;
+    color16 bg;
+    color16* line;              // the trails, kept between frames
+} cctx_racer;
+
+struct color_context;
+
+typedef struct {
+    uint8_t blend;
+    uint8_t opacity;
+    struct color_context* ctx;  // renders into its own line16
+    uint16_t wait;              // frames between renders it asked for, 0 is only when needed
+    uint16_t since;             // frames since it last rendered
+} cctx_layer;
+
+typedef struct {
+    uint8_t count;
+    cctx_layer layers[MAX_LAYERS];
+    uint8_t base_count;         // how many of the bottom layers are composited into base
+    uint8_t shed;               // what base and top were composited at, over blends differently when shed
+    color16 base[NUM_PX];
+    color16 top[NUM_PX];        // the whole stack, kept so a frame with no changes only has to dither it out
+} cctx_layers;
+
+typedef struct color_context {
     uint16_t timeout; //TODO in seconds
 
     uint8_t type; // PATTERN_TYPE_X
@@ -83,13 +139,70 @@ typedef struct {
         cctx_anigradient anigradient;
         cctx_randgradient randgradient;
         cctx_popping popping;
+        cctx_program program;
+        cctx_racer racer;
+        cctx_layers layers;
     };
+
+    color dither[NUM_PX]; // fractional part of each pixel carried into the next frame
+    color frame[NUM_PX];  // last rendered frame, when we can't render straight into the strip
+    bool drawn;           // something has been rendered since parse
+    uint8_t shed;         // governor level, set before each get_frame
+
+    uint8_t map;          // MAP_X
+    color* logical;       // the pattern's own line (or grid) when it is mapped, the leds get gathered from it
+    const struct px_layout* layout; // set before each get_frame, NULL runs mapped patterns down the strip
+
+    color16* line16;      // only for layers, the pattern leaves its 8.8 leds here and the stack drops them to 8 bits
 } color_context;
 
+// the layout worked out into which logical pixel each led shows, for each map
+// all the geometry happens once here, so a mapped frame is one lookup per led
+typedef struct px_layout {
+    uint32_t hash;              // of the layout packet, 0 when there isn't one
+    uint16_t lut[MAP_ANGULAR][NUM_PX];
+    uint8_t cell[NUM_PX];       // which MAP_GRID cell each led is in, y * LAYOUT_GRID + x
+} px_layout;
+
+#define GOV_SHED_QUALITY  1    // from here dithering and alpha blending are off
+#define GOV_MAX_LEVEL     3    // past GOV_SHED_QUALITY each level also stretches frames out
+
+// watches how long frames take and sheds work when they don't fit
+// each level halves the live spots and racers, and past GOV_SHED_QUALITY the refresh rate drops
+typedef struct {
+    uint32_t budget_us;         // how long one frame has
+    uint32_t avg_us;            // smoothed frame cost
+    uint8_t level;              // 0 is nothing shed
+    uint8_t settle;
+    uint16_t calm;              // frames in a row with room to spare
+
+    // what it has been doing
+    uint32_t frames;
+    uint32_t overruns;          // frames that didn't fit
+    uint32_t sheds;
+    uint32_t recovers;
+} frame_governor;
+
+void governor_init(frame_governor* gov, uint32_t budget_us);
+
+// give it what the last frame cost, it returns how many REFRESH_DELAYs to wait in place of frame_sleep
+// a frame_sleep of 0 is an idle pattern, which drops the level back to 0
+uint16_t governor_update(frame_governor* gov, uint32_t cost_us, uint16_t frame_sleep);
+
+// checks the header and hash without parsing anything
+// so a repeat of a pattern we already have can be dropped cheaply
+bool check_packet(uint8_t* data, uint16_t len, uint16_t* seq, uint32_t* hash);
+
 bool parse_packet(uint8_t* data, uint16_t len, color_context* ctx);
 
+// takes a PATTERN_TYPE_LAYOUT packet, out is left alone if it is bad
+bool parse_layout(uint8_t* data, uint16_t len, px_layout* out);
+
 uint16_t get_frame(Adafruit_NeoPixel* px, color_context* ctx, uint16_t deltat);
 
+// call when the layout changes, so patterns that only draw once draw again with it
+void layout_changed(color_context* ctx);
+
 void destroyctx(color_context* ctx);
 
 #endif
\ No newline at end of file
@@ -1,6 +1,7 @@
 #include <Adafruit_NeoPixel.h>
 #include <WiFi.h>
 #include <AsyncUDP.h>
+#include <Preferences.h>
 #include <mutex>
 
 #include "private.h"
@@ -10,17 +11,46 @@
 
 #define PX_PIN 23   // GPIO23
 
-#define REFRESH_DELAY     18   // in ms
-#define LONG_DELAY        2700
-#define LONG_DELAY_FRAMES (LONG_DELAY / REFRESH_DELAY)
-
-Adafruit_NeoPixel px(NUM_PX, PX_PIN, NEO_GRB + NEO_KHZ800);
+Adafruit_NeoPixel px(NUM_PX, PX_PIN, PX_TYPE);
 
 AsyncUDP udp;
 
+// which pattern a context came from, and who to ack once it runs
+typedef struct {
+  uint16_t seq;
+  uint32_t hash;
+  IPAddress from;
+  uint16_t port;
+} delivery;
+
 std::mutex ctxmux;
 volatile color_context newctx;
 volatile bool freshctx = false;
+// both guarded by ctxmux
+delivery newdel;                // what is in newctx
+delivery curdel;                // what loop is running
+bool havecur = false;
+
+// the layout packet is kept in flash as is, and parsed again at boot
+#define LAYOUT_PKT_LEN (offsetof(pattern, layout) + sizeof(pattern_layout) + (NUM_PX * sizeof(pattern_layoutpt)))
+
+Preferences prefs;
+px_layout layout = {};          // only loop touches this, after setup
+// guarded by ctxmux
+uint8_t newlayout[LAYOUT_PKT_LEN];
+delivery layoutdel;
+volatile bool freshlayout = false;
+uint32_t layout_hash = 0;       // what layout has, so repeats just get acked
+
+void send_ack(IPAddress to, uint16_t port, uint16_t seq, uint32_t hash) {
+  pattern_ack ack;
+  ack.seq = seq;
+  ack.hash = hash;
+  // the mac comes back with byte 0 lowest, so the low 32 bits are mostly the vendor prefix
+  // the last three bytes are the ones that differ between boards
+  ack.id = (uint32_t)((ESP.getEfuseMac() >> 24) & 0xffffff);
+  udp.writeTo((uint8_t*)&ack, sizeof(ack), to, port);
+}
 
 void setup() {
 
@@ -34,6 +64,19 @@ void setup() {
   px.clear();
   px.show();
 
+  // get back the layout we were last sent
+  prefs.begin("espcontrol");
+  {
+    uint8_t saved[LAYOUT_PKT_LEN];
+    uint16_t seq;
+    uint32_t hash;
+    size_t len = prefs.getBytes("layout", saved, sizeof(saved));
+    if (len == sizeof(saved) && check_packet(saved, len, &seq, &hash) && parse_layout(saved, len, &layout)) {
+      layout_hash = layout.hash;
+      dbgl("Loaded saved layout");
+    }
+  }
+
   // setup the wifi connection
   WiFi.mode(WIFI_STA);
   WiFi.disconnect();
@@ -71,14 +114,65 @@ void setup() {
 
     dbgf("Got packet of length %d\n", len);
 
+    uint16_t seq;
+    uint32_t hash;
+    if (!check_packet(packet.data(), len, &seq, &hash)) {
+      // no ack, so the sender will resend
+      return;
+    }
+
+    if (((pattern*)packet.data())->type == PATTERN_TYPE_LAYOUT) {
+      // layouts are rare and small, so they just get copied for loop to parse and save
+      if (len != LAYOUT_PKT_LEN) {
+        dbgf("Layout packet is the wrong size for %d pixels\n", NUM_PX);
+      }
+      else if (ctxmux.try_lock()) {
+        if (layout_hash == hash) {
+          dbgl("Already have layout, acking again");
+          send_ack(packet.remoteIP(), packet.remotePort(), seq, hash);
+        }
+        else {
+          memcpy(newlayout, packet.data(), len);
+          layoutdel.seq = seq;
+          layoutdel.hash = hash;
+          layoutdel.from = packet.remoteIP();
+          layoutdel.port = packet.remotePort();
+          freshlayout = true;
+        }
+        ctxmux.unlock();
+      }
+      return;
+    }
+
     if (ctxmux.try_lock()) {
-      freshctx = parse_packet(packet.data(), len, const_cast<color_context*>(&newctx));
+      if (havecur && curdel.seq == seq && curdel.hash == hash) {
+        // already running this one, our ack must have gotten lost
+        dbgl("Already running packet, acking again");
+        send_ack(packet.remoteIP(), packet.remotePort(), seq, hash);
+      }
+      else if (freshctx && newdel.seq == seq && newdel.hash == hash) {
+        // already parsed and waiting for loop, it gets acked when it runs
+        dbgl("Already have packet, dropping repeat");
+      }
+      else {
+        if (freshctx) {
+          // loop never picked up the last one
+          destroyctx(const_cast<color_context*>(&newctx));
+        }
+        freshctx = parse_packet(packet.data(), len, const_cast<color_context*>(&newctx));
+        if (freshctx) {
+          newdel.seq = seq;
+          newdel.hash = hash;
+          newdel.from = packet.remoteIP();
+          newdel.port = packet.remotePort();
+        }
+      }
       ctxmux.unlock();
     }
     else {
       // Could happen if ISR hits during check
       dbgl("Refusing to parse packet, because lock is taken");
-      // for now just wait for resend I guess
+      // not acked, so the sender will resend
     }
   });
 
@@ -92,39 +186,102 @@ error:
 
 void loop() {
   static color_context ctx = {};
-  static uint16_t check_counter = LONG_DELAY_FRAMES;
   static uint16_t delta_steps = 0;
+  static frame_governor gov;
+  static bool govinit = false;
+  static uint8_t gotlayout[LAYOUT_PKT_LEN];
+  delivery applied;
+  bool fresh = false;
+  bool freshmap = false;
+
+  // a new layout, parsed here so it never changes under a frame
+  if (freshlayout && ctxmux.try_lock()) {
+    if (freshlayout) {
+      // our own copy to save, since the next packet can land in newlayout
+      memcpy(gotlayout, newlayout, LAYOUT_PKT_LEN);
+      freshmap = parse_layout(gotlayout, LAYOUT_PKT_LEN, &layout);
+      if (freshmap) {
+        layout_hash = layout.hash;
+        applied = layoutdel;
+      }
+      freshlayout = false;
+    }
+    ctxmux.unlock();
+  }
+
+  if (freshmap) {
+    dbgl("Saving new layout");
+    prefs.putBytes("layout", gotlayout, LAYOUT_PKT_LEN);
+    send_ack(applied.from, applied.port, applied.seq, applied.hash);
+    layout_changed(&ctx);
+  }
 
   // check for update to context from a parsed packet
-  if (check_counter <= 0) {
-    check_counter = LONG_DELAY_FRAMES;
-    if (freshctx && ctxmux.try_lock()) {
-      // should probably disable interrupts during this?
-      if (freshctx) {
-        if (ctx.type != PATTERN_TYPE_NONE) {
-          destroyctx(&ctx);
-        }
-        ctx = *const_cast<color_context*>(&newctx); // copy that over
-        freshctx = false;
+  // this is just a flag check most frames, so new patterns start within a frame
+  if (freshctx && ctxmux.try_lock()) {
+    // should probably disable interrupts during this?
+    if (freshctx) {
+      if (ctx.type != PATTERN_TYPE_NONE) {
+        destroyctx(&ctx);
       }
-      ctxmux.unlock();
-      dbgl("Running new packet");
-      px->clear();
+      ctx = *const_cast<color_context*>(&newctx); // copy that over
+      freshctx = false;
+      curdel = newdel;
+      havecur = true;
+      applied = newdel;
+      fresh = true;
     }
+    ctxmux.unlock();
+  }
+
+  if (fresh) {
+    dbgl("Running new packet");
+    // what the last pattern cost says nothing about this one
+    governor_init(&gov, REFRESH_DELAY * 1000);
+    govinit = true;
+    px.clear();
+    send_ack(applied.from, applied.port, applied.seq, applied.hash);
+  }
+
+  if (!govinit) {
+    governor_init(&gov, REFRESH_DELAY * 1000);
+    govinit = true;
   }
 
-  // render a frame from the context
+  // render a frame from the context, shedding whatever the governor says to
+  uint8_t level = gov.level;
+  ctx.shed = level;
+  ctx.layout = &layout;
+  uint32_t start = micros();
   uint16_t frame_sleep = get_frame(&px, &ctx, delta_steps);
+  uint32_t cost = micros() - start;
   delta_steps = 0;
-  if (frame_sleep == 0 || frame_sleep > LONG_DELAY_FRAMES) {
+  bool idle = (frame_sleep == 0 || frame_sleep > LONG_DELAY_FRAMES);
+
+  frame_sleep = governor_update(&gov, cost, idle ? 0 : frame_sleep);
+  if (gov.level != level) {
+    dbgf("Frames at %uus, governor %u -> %u (%u overruns, %u sheds, %u recovers)\n",
+        (unsigned)gov.avg_us, level, gov.level, (unsigned)gov.overruns, (unsigned)gov.sheds, (unsigned)gov.recovers);
+  }
+
+  if (idle && gov.level != level) {
+    // it just got its quality back, draw again with it now rather than after the long wait
+    return;
+  }
+
+  if (idle) {
     // 0 means no planned update, so just loop for a while, so we can come back and check for an update
-    delay(LONG_DELAY);
-    delta_steps += LONG_DELAY_FRAMES;
-    check_counter = 0;
+    // wait a frame at a time, so a new packet doesn't have to sit out the whole delay
+    for (uint16_t i = 0; i < LONG_DELAY_FRAMES && !freshctx && !freshlayout; i++) {
+      delay(REFRESH_DELAY);
+      delta_steps++;
+    }
     return;
   }
 
-  delay(REFRESH_DELAY * frame_sleep);
-  check_counter -= frame_sleep;
+  // the frame already took some of the slot
+  uint32_t slot = REFRESH_DELAY * frame_sleep;
+  uint32_t spent = cost / 1000;
+  delay((spent < slot) ? (slot - spent) : 0);
   delta_steps += frame_sleep;
 }
@@ -88,25 +88,169 @@ typedef struct {
     pattern_palette colors;
 } pattern_popping;
 
-//TODO racer spots that zip around with velocity
+// a small register machine program, so new effects don't need a reflash
+// the frame program runs once per frame, then the pixel program runs once per pixel
+// each pixel run starts with the registers the frame program left, so per frame work can be hoisted out
+// jumps only go forward, so a program always finishes within its length
+
+#define VM_NUM_REGS     16
+#define VM_MAX_OPS      256     // per program
+
+// registers loaded before a run, the rest start at 0
+#define VM_REG_PX       0       // pixel index (pixel program only)
+#define VM_REG_T        1       // frames since the pattern started
+#define VM_REG_PHASE    2       // place in the duration loop, 0 to 0xffff
+#define VM_REG_NUMPX    3
+
+// ops are (op, a, b, c) with a as the destination, b and c as source registers
+// ops marked imm use b | (c << 8) as a signed 16 bit immediate instead
+// colors are 8.8 fixed point per channel
+// math wraps at 32 bits, and x / -1 is just -x, so no program can fault
+#define VM_HALT         0
+#define VM_LDI          1       // a = imm
+#define VM_LDHI         2       // a = (a & 0xffff) | (imm << 16)
+#define VM_ADDI         3       // a = a + imm
+#define VM_MOV          4       // a = b
+#define VM_ADD          5       // a = b + c
+#define VM_SUB          6       // a = b - c
+#define VM_MUL          7       // a = b * c
+#define VM_MULQ         8       // a = (b * c) >> 16, for 16.16 fixed point
+#define VM_DIV          9       // a = b / c, 0 if c is 0
+#define VM_MOD          10      // a = b % c, 0 if c is 0
+#define VM_AND          11      // a = b & c
+#define VM_OR           12      // a = b | c
+#define VM_XOR          13      // a = b ^ c
+#define VM_SHL          14      // a = b << (c & 31)
+#define VM_SHR          15      // a = b >> (c & 31), arithmetic
+#define VM_MIN          16      // a = min(b, c)
+#define VM_MAX          17      // a = max(b, c)
+#define VM_ABS          18      // a = |b|
+#define VM_LT           19      // a = b < c
+#define VM_TRI          20      // a = triangle wave of the low 16 bits of b, 0 to 0xfffe
+#define VM_RAND         21      // a = random 0 to 0xffff
+#define VM_JMP          22      // skip imm ops forward
+#define VM_JZ           23      // if a is 0 skip b ops forward
+#define VM_GRAD         24      // color = gradient at pixel a
+#define VM_PAL          25      // color = palette range a at b (0 to 0xffff along the range)
+#define VM_RGB          26      // color = (a, b, c) as g, r, b
+#define VM_SCALE        27      // color = color * a / 0x10000
+#define VM_NUM_OPS      28
+
+typedef struct {
+    uint8_t op;
+    uint8_t a;
+    uint8_t b;
+    uint8_t c;
+} pattern_vmop;
+
+typedef struct {
+    uint16_t duration;          // frames per loop of the phase register
+    uint16_t framelen;          // ops in the frame program
+    uint16_t pixellen;          // ops in the pixel program, 0 fills the strip with the frame program's color
+    uint8_t data[];             // frame ops, pixel ops, then a packed pattern_gradient and pattern_palette
+} pattern_program;
+
+#define RACER_WRAP          1   // run off one end and come back on the other
+#define RACER_BOUNCE        2   // turn around at the ends
+
+#define MAX_RACERS          512
+
+// spots that zip around with velocity, leaving a trail that fades to bg
+typedef struct {
+    uint16_t count;             // number of racers
+    int16_t speed_min;          // 8.8 pixels per frame, negative goes backwards
+    int16_t speed_max;
+    int16_t accel_min;          // 1/65536 pixels per frame per frame, turns around with a bounce
+    int16_t accel_max;
+    uint16_t speed_limit;       // 8.8 pixels per frame (0 is no limit)
+    uint8_t trail;              // how much of the trail is left after each frame, out of 256
+    uint8_t edge;               // RACER_WRAP or RACER_BOUNCE
+    color bg;
+    pattern_palette colors;
+} pattern_racer;
+
+// ways to put a layer on top of the ones under it
+#define LAYER_ADD           1
+#define LAYER_MULTIPLY      2
+#define LAYER_MAX           3
+#define LAYER_OVER          4   // brightest channel is the alpha, so black is see through
+
+#define MAX_LAYERS          4
+
+typedef struct {
+    uint8_t blend;
+    uint8_t opacity;            // out of 255
+    uint16_t len;               // length of pat
+    uint8_t pat[];              // a whole pattern packet, that can't be more layers
+} pattern_layer;
+
+// several patterns running at once, stacked bottom first
+typedef struct {
+    uint8_t count;
+    uint8_t data[];             // packed pattern_layers
+} pattern_layers;
+
+// where each led sits, so patterns can run across the shape of a fixture instead of down the strip
+// sent once as its own packet, the device keeps it
+typedef struct {
+    int16_t x;
+    int16_t y;
+} pattern_layoutpt;
+
+typedef struct {
+    int16_t cx;                 // center for the radial and angular maps
+    int16_t cy;
+    uint16_t dir;               // which way the linear map runs, 0x10000 is a full turn from +x
+    uint16_t count;             // has to be NUM_PX
+    pattern_layoutpt pts[];     // in strip order
+} pattern_layout;
+
+// how a pattern's line of pixels lands on the leds
+// patterns still render NUM_PX pixels, the layout picks which one each led shows
+#define MAP_STRIP           0   // down the strip, no layout needed
+#define MAP_LINEAR          1   // along dir
+#define MAP_RADIAL          2   // out from the center
+#define MAP_ANGULAR         3   // around the center, starting at dir
+#define MAP_GRID            4   // popping only, spots are drawn in 2D on a square grid laid over the leds
+
+#define LAYOUT_GRID         16  // cells on a side of the MAP_GRID grid, spot sizes are in cells
 
 #define PATTERN_TYPE_NONE           0
 #define PATTERN_TYPE_GRADIENT       1
 #define PATTERN_TYPE_ANIGRADIENT    2
 #define PATTERN_TYPE_RANDGRADIENT   3
 #define PATTERN_TYPE_POPPING        4
+#define PATTERN_TYPE_PROGRAM        5
+#define PATTERN_TYPE_RACER          6
+#define PATTERN_TYPE_LAYERS         7
+#define PATTERN_TYPE_LAYOUT         8   // not a pattern, replaces the layout
 
 // main definition for a pattern
 typedef struct {
     uint8_t type;
     uint16_t timeout;   // in seconds (max 18 hrs) (0 is no timeout)
+    uint16_t seq;       // picked by the sender, resends of the same pattern keep the same seq
+    uint32_t hash;      // fnv-1a of the whole packet, counting this field as zeros
+    uint8_t map;        // MAP_X, ignored for layers since each layer has its own
     union {
         pattern_gradient grad;
         pattern_anigradient anigrad;
         pattern_randgradient rndgrad;
         pattern_popping pop;
+        pattern_program prog;
+        pattern_racer racer;
+        pattern_layers layers;
+        pattern_layout layout;
     };
 } pattern;
+
+// sent back to the sender once a pattern is running
+// repeats of a running pattern get acked again without being parsed
+typedef struct {
+    uint16_t seq;
+    uint32_t hash;
+    uint32_t id;        // which device is acking, the device specific half of its mac
+} pattern_ack;
 #pragma pack(pop)
 
 #endif
\ No newline at end of file
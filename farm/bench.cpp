@@ -0,0 +1,225 @@
+// Times the renderers on linux, so changes to them can be compared without a board
+// the numbers are x86 numbers, only the ratios between rows carry over to the esp32
+//
+// build:
+//   g++ -O2 -std=gnu++17 -I host -I ../espcontrol bench.cpp ../espcontrol/colorcontrol.cpp -o bench
+//
+// usage:
+//   bench [frames]
+
+#include "colorcontrol.h"
+
+#include <Arduino.h>
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <time.h>
+
+bool farm_verbose = false;
+HostSerial Serial;
+
+// the same gradient as colorcmd/patterns/basic_vm.json
+static const pattern_gradpoint bench_grad[] = {
+    {0, {0, 0, 48}},
+    {36, {0, 32, 0}},
+    {72, {0, 18, 18}},
+    {108, {0, 0, 48}},
+};
+
+// builds packets the way colorcmd serializes them
+typedef struct {
+    uint8_t data[2048];
+    uint16_t len;
+} packet;
+
+static void put8(packet* p, uint8_t v) {
+    p->data[p->len++] = v;
+}
+
+static void put16(packet* p, uint16_t v) {
+    put8(p, v & 0xff);
+    put8(p, v >> 8);
+}
+
+static void put_header(packet* p, uint8_t type) {
+    p->len = 0;
+    put8(p, type);
+    put16(p, 0);            // timeout
+    put16(p, 0);            // seq
+    put16(p, 0);            // hash, parse_packet doesn't check it
+    put16(p, 0);
+    put8(p, MAP_STRIP);
+}
+
+static void put_grad(packet* p) {
+    uint16_t count = sizeof(bench_grad) / sizeof(bench_grad[0]);
+    put16(p, count);
+    for (uint16_t i = 0; i < count; i++) {
+        put16(p, bench_grad[i].n);
+        put8(p, bench_grad[i].c.g);
+        put8(p, bench_grad[i].c.r);
+        put8(p, bench_grad[i].c.b);
+    }
+}
+
+static void put_op(packet* p, uint8_t op, uint8_t a, uint8_t b, uint8_t c) {
+    put8(p, op);
+    put8(p, a);
+    put8(p, b);
+    put8(p, c);
+}
+
+static void put_opi(packet* p, uint8_t op, uint8_t a, int16_t imm) {
+    put_op(p, op, a, (uint16_t)imm & 0xff, (uint16_t)imm >> 8);
+}
+
+static void gradient_pkt(packet* p) {
+    put_header(p, PATTERN_TYPE_GRADIENT);
+    put_grad(p);
+}
+
+static void vm_pkt(packet* p) {
+    // colorcmd/patterns/basic_vm.json, the gradient scrolling and breathing
+    put_header(p, PATTERN_TYPE_PROGRAM);
+    put16(p, 600);          // duration
+    put16(p, 12);           // framelen
+    put16(p, 4);            // pixellen
+
+    put_op(p, VM_MUL, 4, 2, 3);
+    put_opi(p, VM_LDI, 5, 16);
+    put_op(p, VM_SHR, 4, 4, 5);
+    put_opi(p, VM_LDI, 6, 1);
+    put_op(p, VM_SHL, 6, 2, 6);
+    put_op(p, VM_TRI, 6, 6, 0);
+    put_opi(p, VM_LDI, 7, 16384);
+    put_op(p, VM_MUL, 6, 6, 7);
+    put_op(p, VM_SHR, 6, 6, 5);
+    put_opi(p, VM_LDI, 7, 1);
+    put_op(p, VM_SHL, 7, 7, 5);
+    put_op(p, VM_SUB, 6, 7, 6);
+
+    put_op(p, VM_ADD, 8, 0, 4);
+    put_op(p, VM_MOD, 8, 8, 3);
+    put_op(p, VM_GRAD, 8, 0, 0);
+    put_op(p, VM_SCALE, 6, 0, 0);
+
+    put_grad(p);
+    put16(p, 0);            // no palette
+}
+
+// the 8 bit gradient from before the 8.8 pipeline, lerping each pixel and setting it on the strip
+static void render_grad8(const pattern_gradpoint* pts, uint16_t count, Adafruit_NeoPixel* px) {
+    pattern_gradpoint p1 = pts[0];
+    uint16_t cur = 0;
+
+    for (; cur <= p1.n && cur < NUM_PX; cur++) {
+        px->setPixelColor(cur, p1.c.r, p1.c.g, p1.c.b);
+    }
+
+    for (uint16_t i = 1; i < count; i++) {
+        pattern_gradpoint p2 = pts[i];
+        uint16_t seglen = p2.n - p1.n;
+
+        for (; cur <= p2.n && cur < NUM_PX; cur++) {
+            uint16_t step = cur - p1.n;
+            px->setPixelColor(cur,
+                p1.c.r + (((int16_t)p2.c.r - p1.c.r) * step) / seglen,
+                p1.c.g + (((int16_t)p2.c.g - p1.c.g) * step) / seglen,
+                p1.c.b + (((int16_t)p2.c.b - p1.c.b) * step) / seglen);
+        }
+        p1 = p2;
+    }
+
+    for (; cur < NUM_PX; cur++) {
+        px->setPixelColor(cur, p1.c.r, p1.c.g, p1.c.b);
+    }
+}
+
+static uint64_t now_ns() {
+    struct timespec ts;
+    clock_gettime(CLOCK_THREAD_CPUTIME_ID, &ts);
+    return ((uint64_t)ts.tv_sec * 1000000000ULL) + ts.tv_nsec;
+}
+
+static void report(const char* name, uint64_t ns, uint32_t frames, double base) {
+    double per = (double)ns / frames;
+    printf("%-28s %9.1f ns/frame %7.2f ns/px", name, per, per / NUM_PX);
+    if (base > 0) {
+        printf("  %5.2fx", per / base);
+    }
+    printf("\n");
+}
+
+// renders the packet every frame, redrawing even when nothing moved
+// shed at GOV_SHED_QUALITY or more drops the dithering, so the output is just rounded
+static double bench_frames(const char* name, packet* p, uint32_t frames, uint8_t shed, double base) {
+    static color_context ctx;
+    ctx = color_context();
+    if (!parse_packet(p->data, p->len, &ctx)) {
+        printf("%s didn't parse\n", name);
+        exit(1);
+    }
+
+    Adafruit_NeoPixel px(NUM_PX, 0, PX_TYPE);
+
+    // warm up, then time
+    ctx.shed = shed;
+    for (uint32_t i = 0; i < 100; i++) {
+        ctx.drawn = false;
+        get_frame(&px, &ctx, 1);
+    }
+    uint64_t start = now_ns();
+    for (uint32_t i = 0; i < frames; i++) {
+        ctx.drawn = false;
+        get_frame(&px, &ctx, 1);
+    }
+    uint64_t ns = now_ns() - start;
+
+    destroyctx(&ctx);
+    report(name, ns, frames, base);
+    return (double)ns / frames;
+}
+
+static double bench_grad8(uint32_t frames) {
+    Adafruit_NeoPixel px(NUM_PX, 0, PX_TYPE);
+    uint16_t count = sizeof(bench_grad) / sizeof(bench_grad[0]);
+
+    for (uint32_t i = 0; i < 100; i++) {
+        render_grad8(bench_grad, count, &px);
+        px.show();
+    }
+    uint64_t start = now_ns();
+    for (uint32_t i = 0; i < frames; i++) {
+        render_grad8(bench_grad, count, &px);
+        px.show();
+    }
+    uint64_t ns = now_ns() - start;
+
+    report("gradient, old 8 bit", ns, frames, 0);
+    return (double)ns / frames;
+}
+
+int main(int argc, char** argv) {
+    uint32_t frames = (argc > 1) ? strtoul(argv[1], NULL, 0) : 100000;
+    if (frames == 0) {
+        fprintf(stderr, "usage: %s [frames]\n", argv[0]);
+        return 1;
+    }
+
+    printf("%u frames of %d pixels\n", frames, NUM_PX);
+
+    packet p;
+
+    // what the 8.8 pipeline and its dithering cost per pixel over plain 8 bit
+    double grad8 = bench_grad8(frames);
+    gradient_pkt(&p);
+    bench_frames("gradient, 8.8 rounded", &p, frames, GOV_SHED_QUALITY, grad8);
+    double grad = bench_frames("gradient, 8.8 dithered", &p, frames, 0, grad8);
+
+    // the vm against the native path it would replace
+    printf("\n");
+    vm_pkt(&p);
+    bench_frames("program (basic_vm)", &p, frames, 0, grad);
+
+    return 0;
+}
@@ -0,0 +1,493 @@
+// Runs a farm of virtual controllers on linux
+// each node runs the real parse_packet/get_frame into an in memory strip
+// and listens on the real multicast group, so colorcmd can drive it like the real thing
+//
+// build:
+//   g++ -O2 -std=gnu++17 -I host -I ../espcontrol farm.cpp ../espcontrol/colorcontrol.cpp -o farm
+//
+// usage:
+//   farm [-n nodes] [-i iface_ip] [-t seconds] [-r report_seconds] [-p out.ppm] [-s slow_us] [-d slow_seconds] [-T] [-v]
+//
+//   -i joins the group on that interface, use 127.0.0.1 with a sender on loopback
+//   -p rewrites a ppm with one row per node every report
+//   -s makes every frame cost that much more cpu, to push the frame governor around
+//   -d only keeps -s going for the first that many seconds, to watch it recover
+//   -T draws node 0 in the terminal every frame
+
+#include "colorcontrol.h"
+
+#include <Arduino.h>
+
+#include <arpa/inet.h>
+#include <fcntl.h>
+#include <netinet/in.h>
+#include <poll.h>
+#include <signal.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/socket.h>
+#include <time.h>
+#include <unistd.h>
+
+#define GROUP_ADDR  "239.3.6.9"
+#define GROUP_PORT  3690
+#define MAX_PKT     0x9000
+
+bool farm_verbose = false;
+HostSerial Serial;
+
+// which pattern a context came from, and who to ack once it runs
+typedef struct {
+    uint16_t seq;
+    uint32_t hash;
+    struct sockaddr_in from;
+} delivery;
+
+typedef struct {
+    uint32_t id;
+    int sock;
+    Adafruit_NeoPixel* px;
+
+    // same handoff as espcontrol.ino, without the lock since we are single threaded
+    color_context ctx;
+    color_context newctx;
+    bool freshctx;
+    delivery newdel;
+    delivery curdel;
+    bool havecur;
+    uint64_t newat;             // when newctx was parsed
+
+    // mirrors loop()'s sleeping, in REFRESH_DELAY ticks
+    uint16_t since;             // ticks since the last frame
+    uint16_t wait;              // ticks till the next frame
+    frame_governor gov;
+    px_layout layout;           // kept in memory, where the device keeps it in flash
+
+    // stats, reset every report
+    uint32_t packets;
+    uint32_t repeats;
+    uint32_t bad;
+    uint32_t applied;
+    uint32_t acks;
+    uint32_t frames;
+    uint64_t cpu_ns;
+    uint64_t lat_ns;
+    uint64_t lat_max_ns;
+} node;
+
+static volatile bool running = true;
+static uint32_t slow_us = 0;            // injected render cost
+
+static void on_sigint(int) {
+    running = false;
+}
+
+static uint64_t now_ns(clockid_t clk) {
+    struct timespec ts;
+    clock_gettime(clk, &ts);
+    return ((uint64_t)ts.tv_sec * 1000000000ULL) + ts.tv_nsec;
+}
+
+static int open_node_socket(struct in_addr iface) {
+    int sock = socket(AF_INET, SOCK_DGRAM, 0);
+    if (sock < 0) {
+        perror("socket");
+        return -1;
+    }
+
+    // every node binds the same port, they each get their own copy of group traffic
+    int one = 1;
+    setsockopt(sock, SOL_SOCKET, SO_REUSEADDR, &one, sizeof(one));
+
+    struct sockaddr_in addr = {};
+    addr.sin_family = AF_INET;
+    addr.sin_port = htons(GROUP_PORT);
+    addr.sin_addr.s_addr = htonl(INADDR_ANY);
+    if (bind(sock, (struct sockaddr*)&addr, sizeof(addr)) < 0) {
+        perror("bind");
+        close(sock);
+        return -1;
+    }
+
+    struct ip_mreq mreq = {};
+    inet_pton(AF_INET, GROUP_ADDR, &mreq.imr_multiaddr);
+    mreq.imr_interface = iface;
+    if (setsockopt(sock, IPPROTO_IP, IP_ADD_MEMBERSHIP, &mreq, sizeof(mreq)) < 0) {
+        perror("IP_ADD_MEMBERSHIP");
+        close(sock);
+        return -1;
+    }
+
+    if (fcntl(sock, F_SETFL, fcntl(sock, F_GETFL) | O_NONBLOCK) < 0) {
+        perror("fcntl");
+        close(sock);
+        return -1;
+    }
+
+    return sock;
+}
+
+static void send_ack(node* n, delivery* d) {
+    pattern_ack ack;
+    ack.seq = d->seq;
+    ack.hash = d->hash;
+    ack.id = n->id;
+    if (sendto(n->sock, &ack, sizeof(ack), 0, (struct sockaddr*)&d->from, sizeof(d->from)) == sizeof(ack)) {
+        n->acks++;
+    }
+}
+
+static void on_packet(node* n, uint8_t* data, uint16_t len, struct sockaddr_in* from) {
+    // same as the onPacket handler in espcontrol.ino
+    uint16_t seq;
+    uint32_t hash;
+
+    n->packets++;
+
+    if (!check_packet(data, len, &seq, &hash)) {
+        n->bad++;
+        return;
+    }
+
+    if (((pattern*)data)->type == PATTERN_TYPE_LAYOUT) {
+        // single threaded, so it can go straight in
+        delivery d = {seq, hash, *from};
+        if (n->layout.hash == hash) {
+            n->repeats++;
+            send_ack(n, &d);
+        }
+        else if (parse_layout(data, len, &n->layout)) {
+            layout_changed(&n->ctx);
+            n->wait = 0;        // like loop() cutting its idle wait short
+            send_ack(n, &d);
+        }
+        else {
+            n->bad++;
+        }
+        return;
+    }
+
+    if (n->havecur && n->curdel.seq == seq && n->curdel.hash == hash) {
+        n->repeats++;
+        delivery d = n->curdel;
+        d.from = *from;
+        send_ack(n, &d);
+    }
+    else if (n->freshctx && n->newdel.seq == seq && n->newdel.hash == hash) {
+        n->repeats++;
+    }
+    else {
+        if (n->freshctx) {
+            destroyctx(&n->newctx);
+        }
+        n->freshctx = parse_packet(data, len, &n->newctx);
+        if (n->freshctx) {
+            n->newdel.seq = seq;
+            n->newdel.hash = hash;
+            n->newdel.from = *from;
+            n->newat = now_ns(CLOCK_MONOTONIC);
+        } else {
+            n->bad++;
+        }
+    }
+}
+
+static void tick_node(node* n) {
+    // same as loop() in espcontrol.ino, but one REFRESH_DELAY at a time
+    bool fresh = false;
+
+    if (n->freshctx) {
+        if (n->ctx.type != PATTERN_TYPE_NONE) {
+            destroyctx(&n->ctx);
+        }
+        n->ctx = n->newctx;
+        n->freshctx = false;
+        n->curdel = n->newdel;
+        n->havecur = true;
+        fresh = true;
+
+        uint64_t lat = now_ns(CLOCK_MONOTONIC) - n->newat;
+        n->lat_ns += lat;
+        if (lat > n->lat_max_ns) {
+            n->lat_max_ns = lat;
+        }
+        n->applied++;
+
+        n->px->clear();
+        send_ack(n, &n->curdel);
+        governor_init(&n->gov, REFRESH_DELAY * 1000);
+    }
+
+    if (fresh || n->since >= n->wait) {
+        n->ctx.shed = n->gov.level;
+        n->ctx.layout = &n->layout;
+        uint64_t start = now_ns(CLOCK_THREAD_CPUTIME_ID);
+        uint16_t frame_sleep = get_frame(n->px, &n->ctx, n->since);
+        if (slow_us != 0) {
+            // a slower renderer, burning cpu so the governor sees it the same way
+            while (now_ns(CLOCK_THREAD_CPUTIME_ID) - start < slow_us * 1000ULL) {
+            }
+        }
+        uint64_t cost = now_ns(CLOCK_THREAD_CPUTIME_ID) - start;
+        n->cpu_ns += cost;
+        n->frames++;
+
+        uint8_t level = n->gov.level;
+        bool idle = (frame_sleep == 0 || frame_sleep > LONG_DELAY_FRAMES);
+        frame_sleep = governor_update(&n->gov, (uint32_t)(cost / 1000), idle ? 0 : frame_sleep);
+        if (idle) {
+            // same as loop(), straight back if it just got its quality back
+            frame_sleep = (n->gov.level != level) ? 1 : LONG_DELAY_FRAMES;
+        }
+        n->wait = frame_sleep;
+        n->since = 0;
+    }
+
+    n->since++;
+}
+
+static void write_ppm(const char* path, node* nodes, uint32_t count) {
+    FILE* f = fopen(path, "wb");
+    if (f == NULL) {
+        perror(path);
+        return;
+    }
+
+    fprintf(f, "P6\n%d %u\n255\n", NUM_PX, count);
+    for (uint32_t i = 0; i < count; i++) {
+        for (uint16_t p = 0; p < NUM_PX; p++) {
+            uint32_t c = nodes[i].px->getPixelColor(p);
+            uint8_t rgb[3] = {(uint8_t)(c >> 16), (uint8_t)(c >> 8), (uint8_t)c};
+            fwrite(rgb, 1, sizeof(rgb), f);
+        }
+    }
+
+    fclose(f);
+}
+
+static void draw_term(node* n) {
+    fputs("\r", stdout);
+    for (uint16_t p = 0; p < NUM_PX; p++) {
+        uint32_t c = n->px->getPixelColor(p);
+        printf("\x1b[48;2;%u;%u;%um ", (c >> 16) & 0xff, (c >> 8) & 0xff, c & 0xff);
+    }
+    fputs("\x1b[0m", stdout);
+    fflush(stdout);
+}
+
+static void report(node* nodes, uint32_t count, double secs, bool term) {
+    uint64_t packets = 0, repeats = 0, bad = 0, applied = 0, acks = 0, frames = 0;
+    uint64_t cpu_ns = 0, lat_ns = 0, lat_max_ns = 0;
+    uint64_t overruns = 0, sheds = 0, recovers = 0;
+    uint32_t levels[GOV_MAX_LEVEL + 1] = {};
+
+    for (uint32_t i = 0; i < count; i++) {
+        node* n = &nodes[i];
+        packets += n->packets;
+        repeats += n->repeats;
+        bad += n->bad;
+        applied += n->applied;
+        acks += n->acks;
+        frames += n->frames;
+        cpu_ns += n->cpu_ns;
+        lat_ns += n->lat_ns;
+        if (n->lat_max_ns > lat_max_ns) {
+            lat_max_ns = n->lat_max_ns;
+        }
+        // governor counters are since start
+        overruns += n->gov.overruns;
+        sheds += n->gov.sheds;
+        recovers += n->gov.recovers;
+        levels[n->gov.level]++;
+
+        n->packets = n->repeats = n->bad = n->applied = n->acks = n->frames = 0;
+        n->cpu_ns = n->lat_ns = n->lat_max_ns = 0;
+    }
+
+    double fps = frames / secs / count;
+    double us_per_frame = frames ? (cpu_ns / 1000.0) / frames : 0.0;
+    double load = (cpu_ns / 1e9) / secs;   // cores spent rendering
+    double lat_avg_ms = applied ? (lat_ns / 1e6) / applied : 0.0;
+
+    if (term) {
+        fputs("\n", stdout);
+    }
+    printf("%u nodes: %.1f fps/node, %.2f us/frame, %.1f%% of a core (~%.0f nodes/core), "
+           "pkts %llu rep %llu bad %llu applied %llu acks %llu, apply latency avg %.2f ms max %.2f ms\n",
+           count, fps, us_per_frame, load * 100.0, load > 0 ? count / load : 0.0,
+           (unsigned long long)packets, (unsigned long long)repeats, (unsigned long long)bad,
+           (unsigned long long)applied, (unsigned long long)acks, lat_avg_ms, lat_max_ns / 1e6);
+    printf("  governor: levels");
+    for (uint8_t l = 0; l <= GOV_MAX_LEVEL; l++) {
+        printf(" %u", levels[l]);
+    }
+    printf(", overruns %llu sheds %llu recovers %llu, node 0 at %u us/frame\n",
+           (unsigned long long)overruns, (unsigned long long)sheds, (unsigned long long)recovers,
+           nodes[0].gov.avg_us);
+    fflush(stdout);
+}
+
+static void usage(const char* name) {
+    fprintf(stderr, "usage: %s [-n nodes] [-i iface_ip] [-t seconds] [-r report_seconds] [-p out.ppm] [-s slow_us] [-d slow_seconds] [-T] [-v]\n", name);
+}
+
+int main(int argc, char** argv) {
+    uint32_t count = 16;
+    struct in_addr iface = {htonl(INADDR_ANY)};
+    double runfor = 0;
+    double every = 1.0;
+    const char* ppm = NULL;
+    bool term = false;
+    double slow_for = 0;
+    uint32_t slow = 0;
+    int opt;
+
+    while ((opt = getopt(argc, argv, "n:i:t:r:p:s:d:Tv")) != -1) {
+        switch (opt) {
+        case 'n':
+            count = strtoul(optarg, NULL, 0);
+            break;
+        case 'i':
+            if (inet_pton(AF_INET, optarg, &iface) != 1) {
+                fprintf(stderr, "Bad interface address %s\n", optarg);
+                return 1;
+            }
+            break;
+        case 't':
+            runfor = atof(optarg);
+            break;
+        case 'r':
+            every = atof(optarg);
+            break;
+        case 'p':
+            ppm = optarg;
+            break;
+        case 's':
+            slow = strtoul(optarg, NULL, 0);
+            break;
+        case 'd':
+            slow_for = atof(optarg);
+            break;
+        case 'T':
+            term = true;
+            break;
+        case 'v':
+            farm_verbose = true;
+            break;
+        default:
+            usage(argv[0]);
+            return 1;
+        }
+    }
+
+    if (count == 0 || every <= 0) {
+        usage(argv[0]);
+        return 1;
+    }
+
+    node* nodes = new node[count]();
+    struct pollfd* fds = new struct pollfd[count];
+
+    for (uint32_t i = 0; i < count; i++) {
+        nodes[i].id = i;
+        nodes[i].px = new Adafruit_NeoPixel(NUM_PX, 0, PX_TYPE);
+        governor_init(&nodes[i].gov, REFRESH_DELAY * 1000);
+        nodes[i].sock = open_node_socket(iface);
+        if (nodes[i].sock < 0) {
+            fprintf(stderr, "Could only open %u of %u nodes\n", i, count);
+            return 1;
+        }
+        fds[i].fd = nodes[i].sock;
+        fds[i].events = POLLIN;
+    }
+
+    signal(SIGINT, on_sigint);
+
+    printf("Running %u nodes on %s:%d\n", count, GROUP_ADDR, GROUP_PORT);
+
+    static uint8_t buf[MAX_PKT];
+    uint64_t period = REFRESH_DELAY * 1000000ULL;
+    uint64_t start = now_ns(CLOCK_MONOTONIC);
+    uint64_t next_tick = start;
+    uint64_t next_report = start + (uint64_t)(every * 1e9);
+    uint64_t last_report = start;
+    slow_us = slow;
+
+    while (running) {
+        uint64_t now = now_ns(CLOCK_MONOTONIC);
+
+        if (runfor > 0 && now - start >= (uint64_t)(runfor * 1e9)) {
+            break;
+        }
+
+        if (slow_us != 0 && slow_for > 0 && now - start >= (uint64_t)(slow_for * 1e9)) {
+            slow_us = 0;
+        }
+
+        if (now >= next_tick) {
+            for (uint32_t i = 0; i < count; i++) {
+                tick_node(&nodes[i]);
+            }
+            if (term) {
+                draw_term(&nodes[0]);
+            }
+
+            // if we fell behind, drop the ticks rather than bursting to catch up
+            next_tick += period;
+            if (next_tick < now) {
+                next_tick = now + period;
+            }
+        }
+
+        if (now >= next_report) {
+            report(nodes, count, (now - last_report) / 1e9, term);
+            if (ppm != NULL) {
+                write_ppm(ppm, nodes, count);
+            }
+            last_report = now;
+            next_report = now + (uint64_t)(every * 1e9);
+        }
+
+        now = now_ns(CLOCK_MONOTONIC);
+        int wait_ms = (next_tick > now) ? (int)((next_tick - now) / 1000000ULL) : 0;
+        int ready = poll(fds, count, wait_ms);
+        if (ready <= 0) {
+            continue;
+        }
+
+        for (uint32_t i = 0; i < count; i++) {
+            if (!(fds[i].revents & POLLIN)) {
+                continue;
+            }
+
+            struct sockaddr_in from;
+            socklen_t fromlen = sizeof(from);
+            ssize_t len;
+            while ((len = recvfrom(fds[i].fd, buf, sizeof(buf), 0, (struct sockaddr*)&from, &fromlen)) >= 0) {
+                on_packet(&nodes[i], buf, (uint16_t)len, &from);
+                fromlen = sizeof(from);
+            }
+        }
+    }
+
+    report(nodes, count, (now_ns(CLOCK_MONOTONIC) - last_report) / 1e9, term);
+    if (ppm != NULL) {
+        write_ppm(ppm, nodes, count);
+    }
+
+    for (uint32_t i = 0; i < count; i++) {
+        close(nodes[i].sock);
+        if (nodes[i].freshctx) {
+            destroyctx(&nodes[i].newctx);
+        }
+        if (nodes[i].ctx.type != PATTERN_TYPE_NONE) {
+            destroyctx(&nodes[i].ctx);
+        }
+        delete nodes[i].px;
+    }
+    delete[] nodes;
+    delete[] fds;
+
+    return 0;
+}
@@ -0,0 +1,102 @@
+#ifndef ADAFRUIT_NEOPIXEL_H
+#define ADAFRUIT_NEOPIXEL_H
+
+// an in memory strip that keeps its pixels the way the real library does
+// wire order from the type flags, and brightness scaled on the way in
+
+#include <stdint.h>
+#include <string.h>
+
+#define NEO_RGB     ((0 << 6) | (0 << 4) | (1 << 2) | (2))
+#define NEO_GRB     ((1 << 6) | (1 << 4) | (0 << 2) | (2))
+#define NEO_BRG     ((1 << 6) | (1 << 4) | (2 << 2) | (0))
+#define NEO_KHZ800  0x0000
+
+class Adafruit_NeoPixel {
+public:
+    Adafruit_NeoPixel(uint16_t n, int16_t pin = 6, uint16_t type = NEO_GRB + NEO_KHZ800) :
+        numLEDs(n), brightness(0), shows(0) {
+        (void)pin;
+        rOffset = (type >> 4) & 0b11;
+        gOffset = (type >> 2) & 0b11;
+        bOffset = type & 0b11;
+        pixels = new uint8_t[n * 3]();
+    }
+
+    ~Adafruit_NeoPixel() {
+        delete[] pixels;
+    }
+
+    void begin() {}
+
+    void show() {
+        shows++;
+    }
+
+    bool canShow() {
+        return true;
+    }
+
+    void clear() {
+        memset(pixels, 0, numLEDs * 3);
+    }
+
+    void setPixelColor(uint16_t n, uint8_t r, uint8_t g, uint8_t b) {
+        if (n >= numLEDs) {
+            return;
+        }
+        if (brightness) {
+            r = (r * brightness) >> 8;
+            g = (g * brightness) >> 8;
+            b = (b * brightness) >> 8;
+        }
+        uint8_t* p = &pixels[n * 3];
+        p[rOffset] = r;
+        p[gOffset] = g;
+        p[bOffset] = b;
+    }
+
+    uint32_t getPixelColor(uint16_t n) const {
+        if (n >= numLEDs) {
+            return 0;
+        }
+        const uint8_t* p = &pixels[n * 3];
+        if (brightness) {
+            return (((uint32_t)(p[rOffset] << 8) / brightness) << 16) |
+                   (((uint32_t)(p[gOffset] << 8) / brightness) << 8) |
+                   ((uint32_t)(p[bOffset] << 8) / brightness);
+        }
+        return ((uint32_t)p[rOffset] << 16) | ((uint32_t)p[gOffset] << 8) | p[bOffset];
+    }
+
+    void setBrightness(uint8_t b) {
+        brightness = b + 1;
+    }
+
+    uint8_t getBrightness() const {
+        return brightness - 1;
+    }
+
+    uint8_t* getPixels() const {
+        return pixels;
+    }
+
+    uint16_t numPixels() const {
+        return numLEDs;
+    }
+
+    uint32_t showCount() const {
+        return shows;
+    }
+
+private:
+    uint16_t numLEDs;
+    uint8_t brightness;
+    uint8_t* pixels;
+    uint8_t rOffset;
+    uint8_t gOffset;
+    uint8_t bOffset;
+    uint32_t shows;
+};
+
+#endif
@@ -0,0 +1,74 @@
+#ifndef ARDUINO_H
+#define ARDUINO_H
+
+// just enough of Arduino for colorcontrol.cpp to build on linux
+
+#include <stdint.h>
+#include <stddef.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+
+#include <algorithm>
+#include <vector>
+
+extern bool farm_verbose;
+
+// dbg.h prints through Serial, keep it quiet unless asked, hundreds of nodes get noisy
+class HostSerial {
+public:
+    void begin(unsigned long) {}
+
+    template <typename... Args>
+    void printf(const char* fmt, Args... args) {
+        if (farm_verbose) {
+            ::printf(fmt, args...);
+        }
+    }
+
+    void print(const char* s) {
+        if (farm_verbose) {
+            fputs(s, stdout);
+        }
+    }
+
+    void println(const char* s) {
+        if (farm_verbose) {
+            puts(s);
+        }
+    }
+};
+
+extern HostSerial Serial;
+
+static inline long random(long howbig) {
+    if (howbig <= 0) {
+        return 0;
+    }
+    return rand() % howbig;
+}
+
+static inline long random(long howsmall, long howbig) {
+    if (howsmall >= howbig) {
+        return howsmall;
+    }
+    return howsmall + random(howbig - howsmall);
+}
+
+static inline unsigned long micros() {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (unsigned long)(ts.tv_sec * 1000000UL + ts.tv_nsec / 1000);
+}
+
+static inline unsigned long millis() {
+    return micros() / 1000;
+}
+
+static inline void delay(unsigned long ms) {
+    usleep(ms * 1000);
+}
+
+#endif